@@ -1,10 +1,39 @@
 #include <algorithm>
+#include <array>
+#include <climits>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
-#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // https://github.com/nothings/stb
 // a header-only library for image loading
 extern "C" {
@@ -13,161 +42,3905 @@ extern "C" {
 }
 
 /*
-Represents a single RGB pixel value
+Represents a single RGB pixel value
+*/
+struct RGBPixel {
+    std::uint8_t r;
+    std::uint8_t g;
+    std::uint8_t b;
+
+    RGBPixel() : r(0), g(0), b(0) {}
+    RGBPixel(uint8_t _r, uint8_t _g, uint8_t _b) : r(_r), g(_g), b(_b) {}
+};
+
+// pixels are read straight out of memory as byte triples, including the
+// buffer stb_image decodes into, which is viewed as pixels without a copy
+static_assert(sizeof(RGBPixel) == 3, "RGBPixel must be packed as 3 bytes");
+static_assert(alignof(RGBPixel) == 1, "RGBPixel must be byte aligned");
+static_assert(std::is_standard_layout<RGBPixel>::value,
+              "RGBPixel must be laid out as its channels in order");
+
+/*
+A view over pixels held elsewhere, either in the buffer stb_image decoded
+the image into, or in a vector of converted pixels. The quantizers read the
+image through it, so it is never copied into a buffer of its own
+*/
+struct PixelView {
+    RGBPixel* pixels;
+    std::size_t count;
+
+    PixelView() : pixels(nullptr), count(0) {}
+    PixelView(RGBPixel* _pixels, std::size_t _count)
+        : pixels(_pixels), count(_count) {}
+    explicit PixelView(std::vector<RGBPixel>& _pixels)
+        : pixels(_pixels.data()), count(_pixels.size()) {}
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    RGBPixel* data() { return pixels; }
+    const RGBPixel* data() const { return pixels; }
+    RGBPixel& operator[](std::size_t i) { return pixels[i]; }
+    const RGBPixel& operator[](std::size_t i) const { return pixels[i]; }
+    const RGBPixel* begin() const { return pixels; }
+    const RGBPixel* end() const { return pixels + count; }
+};
+
+/*
+Represents a color along with the number of pixels it stands for
+*/
+struct WeightedColor {
+    RGBPixel color;
+    std::uint_fast32_t count;
+
+    WeightedColor() : color(), count(0) {}
+    WeightedColor(const RGBPixel& _color, std::uint_fast32_t _count)
+        : color(_color), count(_count) {}
+};
+
+// number of bits kept per channel when building the color histogram
+// 5 bits gives 32x32x32 cells, which is plenty to pick a small palette from
+const std::uint_fast32_t HISTOGRAM_BITS = 5;
+
+/*
+Lets the median cut treat plain pixels and weighted colors alike
+*/
+inline const RGBPixel& colorOf(const RGBPixel& p) { return p; }
+
+inline const RGBPixel& colorOf(const WeightedColor& c) { return c.color; }
+
+inline std::uint_fast32_t weightOf(const RGBPixel&) { return 1; }
+
+inline std::uint_fast32_t weightOf(const WeightedColor& c) { return c.count; }
+
+enum class Channel { Red, Green, Blue };
+
+/*
+How median cut picks the next box and where it cuts it. Median splits the
+box with the widest channel range at the median of that channel, variance
+splits the box with the largest squared error where the error of the two
+halves is smallest
+*/
+enum class SplitPolicy { Median, Variance };
+
+/*
+The color space a palette is picked in. Colors are stored as byte triples
+in every space, and converted back to sRGB once picked
+*/
+enum class ColorSpace { SRGB, Oklab, YCbCr };
+
+/*
+A box is a [begin, end) range over the buffer being quantized, standing for
+weight pixels. Its channel bounds are computed once when it is created,
+and its widest channel range is cached as the score used to decide which
+box gets split next. With the variance policy, its squared error and the
+value to cut below are cached as well. A box that has already been split
+ahead of time keeps the index of its children, and a box that made it into
+the palette tree keeps the index of its node
+*/
+struct Box {
+    std::size_t begin;
+    std::size_t end;
+    std::uint_fast64_t weight;
+    RGBPixel lo;
+    RGBPixel hi;
+    std::uint8_t range;
+    Channel channel;
+    double error;
+    std::int_fast32_t cut;
+    std::int_fast32_t split;
+    std::int_fast32_t node;
+
+    Box(std::size_t _begin, std::size_t _end, std::uint_fast64_t _weight,
+        const RGBPixel& _lo, const RGBPixel& _hi)
+        : begin(_begin), end(_end), weight(_weight), lo(_lo), hi(_hi),
+          error(0.0), cut(-1), split(-1), node(-1) {
+        std::uint8_t redRange = hi.r - lo.r;
+        std::uint8_t greenRange = hi.g - lo.g;
+        std::uint8_t blueRange = hi.b - lo.b;
+
+        if (redRange >= greenRange && redRange >= blueRange) {
+            range = redRange;
+            channel = Channel::Red;
+        } else if (greenRange >= redRange && greenRange >= blueRange) {
+            range = greenRange;
+            channel = Channel::Green;
+        } else {
+            range = blueRange;
+            channel = Channel::Blue;
+        }
+    }
+};
+
+/*
+Orders boxes in the scheduler heap, so that the box with the largest error,
+or the widest range when errors are not tracked, sits on top, and the box
+standing for more pixels wins a tie, however the pixels are stored
+*/
+bool cmpBoxScore(const Box& a, const Box& b) {
+    if (a.error != b.error)
+        return a.error < b.error;
+    if (a.range != b.range)
+        return a.range < b.range;
+    return a.weight < b.weight;
+}
+
+/*
+Determines the lower and upper bound of every color channel in a box, and
+the number of pixels it stands for
+*/
+template <typename Iterator>
+void measureBox(Iterator first, Iterator last, RGBPixel& lo, RGBPixel& hi,
+                std::uint_fast64_t& weight) {
+    lo = RGBPixel(255, 255, 255);
+    hi = RGBPixel(0, 0, 0);
+    weight = 0;
+    for (Iterator itr = first; itr != last; itr++) {
+        const RGBPixel& p = colorOf(*itr);
+        weight += weightOf(*itr);
+        lo.r = std::min(lo.r, p.r);
+        lo.g = std::min(lo.g, p.g);
+        lo.b = std::min(lo.b, p.b);
+        hi.r = std::max(hi.r, p.r);
+        hi.g = std::max(hi.g, p.g);
+        hi.b = std::max(hi.b, p.b);
+    }
+}
+
+/*
+Worker pool
+
+A fixed set of threads that run batches of tasks. The calling thread works
+on the batch too, so a pool of size 1 has no extra threads and runs every
+task inline
+*/
+class WorkerPool {
+  public:
+    explicit WorkerPool(const std::size_t numThreads)
+        : numThreads(std::max<std::size_t>(1, numThreads)) {
+        for (std::size_t i = 1; i < this->numThreads; i++)
+            threads.push_back(std::thread(&WorkerPool::workerLoop, this));
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    std::size_t size() const { return numThreads; }
+
+    /*
+    Runs task(i) for every i in [0, count), and returns once all of them
+    are done and every worker has let go of the batch. Tasks must not run
+    batches of their own on the same pool
+    */
+    void run(const std::size_t count,
+             const std::function<void(std::size_t)>& task) {
+        if (threads.empty() || count <= 1) {
+            for (std::size_t i = 0; i < count; i++)
+                task(i);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch = &task;
+            batchSize = count;
+            next = 0;
+            idle = 0;
+            generation++;
+        }
+        wake.notify_all();
+
+        work(task, count);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return idle == threads.size(); });
+        batch = nullptr;
+    }
+
+  private:
+    void work(const std::function<void(std::size_t)>& task,
+              const std::size_t count) {
+        for (std::size_t i = next++; i < count; i = next++)
+            task(i);
+    }
+
+    void workerLoop() {
+        std::uint_fast64_t seen = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            const std::function<void(std::size_t)>& task = *batch;
+            const std::size_t count = batchSize;
+            lock.unlock();
+
+            work(task, count);
+
+            lock.lock();
+            idle++;
+            if (idle == threads.size())
+                done.notify_one();
+        }
+    }
+
+    const std::size_t numThreads;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(std::size_t)>* batch = nullptr;
+    std::size_t batchSize = 0;
+    std::atomic<std::size_t> next{0};
+    std::size_t idle = 0;
+    std::uint_fast64_t generation = 0;
+    bool stopping = false;
+};
+
+/*
+Splits [begin, end) into parts even chunks, and returns the bounds of the
+i-th one
+*/
+void chunkRange(const std::size_t begin, const std::size_t end,
+                const std::size_t parts, const std::size_t i,
+                std::size_t& first, std::size_t& last) {
+    const std::size_t count = end - begin;
+    first = begin + count * i / parts;
+    last = begin + count * (i + 1) / parts;
+}
+
+// boxes with at least this many pixels are worked on by every thread of the
+// pool together, smaller ones are handed out to the threads as whole tasks
+const std::size_t COOPERATIVE_MIN_PIXELS = 1 << 18;
+
+/*
+Planar pixel storage
+
+The median cut works on pixels stored planar, with every channel in its own
+64-byte aligned array. Measuring, splitting and averaging a box are all
+per-channel work, so they can run on full-width vectors, and each pass only
+touches the channels it needs
+*/
+
+const std::size_t PLANE_ALIGNMENT = 64;
+
+struct AlignedFree {
+    template <typename T> void operator()(T* memory) const {
+        std::free(memory);
+    }
+};
+
+typedef std::unique_ptr<std::uint8_t[], AlignedFree> AlignedPlane;
+
+/*
+Allocates a plane of at least size bytes, rounded up to the alignment
+*/
+AlignedPlane allocatePlane(const std::size_t size) {
+    const std::size_t padded =
+        std::max<std::size_t>(1, (size + PLANE_ALIGNMENT - 1) /
+                                     PLANE_ALIGNMENT) *
+        PLANE_ALIGNMENT;
+    std::uint8_t* plane = static_cast<std::uint8_t*>(
+        std::aligned_alloc(PLANE_ALIGNMENT, padded));
+    if (plane == nullptr)
+        throw std::bad_alloc();
+    return AlignedPlane(plane);
+}
+
+struct PlanarPixels {
+    std::size_t count;
+    AlignedPlane red;
+    AlignedPlane green;
+    AlignedPlane blue;
+
+    explicit PlanarPixels(const std::size_t _count)
+        : count(_count), red(allocatePlane(_count)),
+          green(allocatePlane(_count)), blue(allocatePlane(_count)) {}
+
+    std::size_t size() const { return count; }
+
+    std::uint8_t* plane(const Channel channel) const {
+        if (channel == Channel::Red)
+            return red.get();
+        else if (channel == Channel::Green)
+            return green.get();
+        else
+            return blue.get();
+    }
+};
+
+typedef void (*DeinterleaveKernel)(const std::uint8_t*, std::size_t,
+                                   std::uint8_t*, std::uint8_t*,
+                                   std::uint8_t*);
+
+/*
+Splits count packed pixels into three planes, one byte triple at a time
+*/
+void scalarDeinterleave(const std::uint8_t* bytes, const std::size_t count,
+                        std::uint8_t* red, std::uint8_t* green,
+                        std::uint8_t* blue) {
+    for (std::size_t i = 0; i < count; i++) {
+        red[i] = bytes[i * 3 + 0];
+        green[i] = bytes[i * 3 + 1];
+        blue[i] = bytes[i * 3 + 2];
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+Splits the pixels in blocks of 16, shuffling the bytes of each channel out
+of the three registers the block spans
+*/
+__attribute__((target("ssse3"))) void
+ssse3Deinterleave(const std::uint8_t* bytes, const std::size_t count,
+                  std::uint8_t* red, std::uint8_t* green,
+                  std::uint8_t* blue) {
+    const __m128i redA =
+        _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                      -1);
+    const __m128i redB =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1,
+                      -1);
+    const __m128i redC =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10,
+                      13);
+    const __m128i greenA =
+        _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                      -1);
+    const __m128i greenB =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1,
+                      -1);
+    const __m128i greenC =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11,
+                      14);
+    const __m128i blueA =
+        _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                      -1);
+    const __m128i blueB =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1,
+                      -1);
+    const __m128i blueC =
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12,
+                      15);
+
+    const std::size_t blocks = count / 16;
+    for (std::size_t i = 0; i < blocks; i++) {
+        const __m128i* block = reinterpret_cast<const __m128i*>(bytes + i * 48);
+        __m128i a = _mm_loadu_si128(block + 0);
+        __m128i b = _mm_loadu_si128(block + 1);
+        __m128i c = _mm_loadu_si128(block + 2);
+
+        __m128i r = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(a, redA), _mm_shuffle_epi8(b, redB)),
+            _mm_shuffle_epi8(c, redC));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, greenA),
+                                              _mm_shuffle_epi8(b, greenB)),
+                                 _mm_shuffle_epi8(c, greenC));
+        __m128i bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, blueA),
+                                               _mm_shuffle_epi8(b, blueB)),
+                                  _mm_shuffle_epi8(c, blueC));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(red + i * 16), r);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(green + i * 16), g);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(blue + i * 16), bl);
+    }
+    scalarDeinterleave(bytes + blocks * 48, count - blocks * 16,
+                       red + blocks * 16, green + blocks * 16,
+                       blue + blocks * 16);
+}
+#endif
+
+/*
+Converts packed pixels to planar storage, with the widest kernel the CPU
+supports
+*/
+PlanarPixels deinterleavePixels(const PixelView& source) {
+#if defined(__GNUC__) && defined(__x86_64__)
+    static const DeinterleaveKernel kernel =
+        __builtin_cpu_supports("ssse3") ? ssse3Deinterleave
+                                        : scalarDeinterleave;
+#else
+    static const DeinterleaveKernel kernel = scalarDeinterleave;
+#endif
+    PlanarPixels pixels(source.size());
+    if (!source.empty())
+        kernel(reinterpret_cast<const std::uint8_t*>(source.data()),
+               source.size(), pixels.red.get(), pixels.green.get(),
+               pixels.blue.get());
+    return pixels;
+}
+
+/*
+Plane kernels
+
+Every box of planar pixels is measured and averaged one plane at a time.
+The vectorized kernels process 16 or 32 bytes of a plane per step, and are
+picked at runtime from the features of the CPU, with a scalar fallback
+*/
+
+struct PlaneKernels {
+    void (*bounds)(const std::uint8_t*, std::size_t, std::uint8_t&,
+                   std::uint8_t&);
+    std::uint_fast64_t (*sum)(const std::uint8_t*, std::size_t);
+};
+
+/*
+Widens lo and hi with count bytes of a plane
+*/
+void scalarPlaneBounds(const std::uint8_t* plane, const std::size_t count,
+                       std::uint8_t& lo, std::uint8_t& hi) {
+    for (std::size_t i = 0; i < count; i++) {
+        lo = std::min(lo, plane[i]);
+        hi = std::max(hi, plane[i]);
+    }
+}
+
+/*
+Sums count bytes of a plane
+*/
+std::uint_fast64_t scalarPlaneSum(const std::uint8_t* plane,
+                                  const std::size_t count) {
+    std::uint_fast64_t sum = 0;
+    for (std::size_t i = 0; i < count; i++)
+        sum += plane[i];
+    return sum;
+}
+
+#ifdef __SSE2__
+void sse2PlaneBounds(const std::uint8_t* plane, const std::size_t count,
+                     std::uint8_t& lo, std::uint8_t& hi) {
+    const std::size_t blocks = count / 16;
+    if (blocks > 0) {
+        __m128i mins = _mm_set1_epi8(-1);
+        __m128i maxs = _mm_setzero_si128();
+        for (std::size_t i = 0; i < blocks; i++) {
+            __m128i v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(plane + i * 16));
+            mins = _mm_min_epu8(mins, v);
+            maxs = _mm_max_epu8(maxs, v);
+        }
+
+        alignas(16) std::uint8_t minBytes[16];
+        alignas(16) std::uint8_t maxBytes[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(minBytes), mins);
+        _mm_store_si128(reinterpret_cast<__m128i*>(maxBytes), maxs);
+        scalarPlaneBounds(minBytes, 16, lo, hi);
+        scalarPlaneBounds(maxBytes, 16, lo, hi);
+    }
+    scalarPlaneBounds(plane + blocks * 16, count - blocks * 16, lo, hi);
+}
+
+/*
+Sums the bytes with sum of absolute differences against zero, which adds up
+every 8 bytes into a 64 bit lane
+*/
+std::uint_fast64_t sse2PlaneSum(const std::uint8_t* plane,
+                                const std::size_t count) {
+    const std::size_t blocks = count / 16;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sums = _mm_setzero_si128();
+    for (std::size_t i = 0; i < blocks; i++) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(plane + i * 16));
+        sums = _mm_add_epi64(sums, _mm_sad_epu8(v, zero));
+    }
+
+    alignas(16) std::uint64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sums);
+    return lanes[0] + lanes[1] +
+           scalarPlaneSum(plane + blocks * 16, count - blocks * 16);
+}
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2"))) void
+avx2PlaneBounds(const std::uint8_t* plane, const std::size_t count,
+                std::uint8_t& lo, std::uint8_t& hi) {
+    const std::size_t blocks = count / 32;
+    if (blocks > 0) {
+        __m256i mins = _mm256_set1_epi8(-1);
+        __m256i maxs = _mm256_setzero_si256();
+        for (std::size_t i = 0; i < blocks; i++) {
+            __m256i v = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(plane + i * 32));
+            mins = _mm256_min_epu8(mins, v);
+            maxs = _mm256_max_epu8(maxs, v);
+        }
+
+        alignas(32) std::uint8_t minBytes[32];
+        alignas(32) std::uint8_t maxBytes[32];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(minBytes), mins);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(maxBytes), maxs);
+        scalarPlaneBounds(minBytes, 32, lo, hi);
+        scalarPlaneBounds(maxBytes, 32, lo, hi);
+    }
+    scalarPlaneBounds(plane + blocks * 32, count - blocks * 32, lo, hi);
+}
+
+__attribute__((target("avx2"))) std::uint_fast64_t
+avx2PlaneSum(const std::uint8_t* plane, const std::size_t count) {
+    const std::size_t blocks = count / 32;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sums = _mm256_setzero_si256();
+    for (std::size_t i = 0; i < blocks; i++) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(plane + i * 32));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(v, zero));
+    }
+
+    alignas(32) std::uint64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           scalarPlaneSum(plane + blocks * 32, count - blocks * 32);
+}
+#endif
+
+/*
+Returns the widest plane kernels the CPU supports, picked the first time
+they are needed
+*/
+const PlaneKernels& planeKernels() {
+    static const PlaneKernels kernels = []() -> PlaneKernels {
+#if defined(__GNUC__) && defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2"))
+            return {avx2PlaneBounds, avx2PlaneSum};
+#endif
+#ifdef __SSE2__
+        return {sse2PlaneBounds, sse2PlaneSum};
+#else
+        return {scalarPlaneBounds, scalarPlaneSum};
+#endif
+    }();
+    return kernels;
+}
+
+/*
+Counts the values of count bytes of a plane into 256 buckets. Runs of equal
+values are common in images, so four sets of 32 bit buckets are filled in
+turn to keep consecutive increments from waiting on each other, and are
+flushed into the totals before they can overflow
+*/
+void planeHistogram(const std::uint8_t* plane, const std::size_t count,
+                    std::uint_fast64_t* buckets) {
+    const std::size_t flushEvery = std::size_t(1) << 32;
+    std::fill(buckets, buckets + 256, 0);
+    for (std::size_t start = 0; start < count; start += flushEvery) {
+        const std::size_t last = start + std::min(flushEvery, count - start);
+        std::uint32_t partials[4][256] = {{0}};
+        std::size_t i = start;
+        for (; i + 4 <= last; i += 4) {
+            partials[0][plane[i + 0]]++;
+            partials[1][plane[i + 1]]++;
+            partials[2][plane[i + 2]]++;
+            partials[3][plane[i + 3]]++;
+        }
+        for (; i < last; i++)
+            partials[0][plane[i]]++;
+
+        for (std::size_t value = 0; value < 256; value++)
+            buckets[value] += partials[0][value] + partials[1][value] +
+                              partials[2][value] + partials[3][value];
+    }
+}
+
+/*
+Counts every plane of [begin, end) of planar pixels into its own 256
+buckets, red first. Large ranges are counted in chunks by every thread of
+the pool
+*/
+std::array<std::uint_fast64_t, 3 * 256>
+planarHistograms(const PlanarPixels& pixels, const std::size_t begin,
+                 const std::size_t end, WorkerPool& pool) {
+    const std::size_t parts =
+        end - begin >= COOPERATIVE_MIN_PIXELS ? pool.size() : 1;
+
+    std::vector<std::array<std::uint_fast64_t, 3 * 256>> chunks(parts);
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(begin, end, parts, i, first, last);
+        planeHistogram(pixels.red.get() + first, last - first,
+                       chunks[i].data());
+        planeHistogram(pixels.green.get() + first, last - first,
+                       chunks[i].data() + 256);
+        planeHistogram(pixels.blue.get() + first, last - first,
+                       chunks[i].data() + 2 * 256);
+    });
+
+    std::array<std::uint_fast64_t, 3 * 256> histograms = chunks[0];
+    for (std::size_t i = 1; i < parts; i++)
+        for (std::size_t value = 0; value < 3 * 256; value++)
+            histograms[value] += chunks[i][value];
+    return histograms;
+}
+
+/*
+Creates a box over [begin, end) from weighted histograms of its three
+channels, red first, for the variance policy. The bounds come from the
+outermost occupied buckets, and the squared error of the box from the
+count, sum and sum of squares of every channel.
+
+The cut is found with running sums over the buckets. Cutting below t
+leaves halves whose squared errors add up to the total sum of squares,
+minus sum^2 / count of each half, so the best cut along a channel is where
+those two terms add up to the most, and the channel where that beats the
+uncut box by the most is cut
+*/
+Box varianceBox(const std::size_t begin, const std::size_t end,
+                const std::uint_fast64_t* histograms) {
+    std::uint8_t bounds[2][3];
+    for (std::size_t c = 0; c < 3; c++) {
+        const std::uint_fast64_t* buckets = histograms + c * 256;
+        std::size_t lo = 0;
+        std::size_t hi = 255;
+        while (lo < 255 && buckets[lo] == 0)
+            lo++;
+        while (hi > lo && buckets[hi] == 0)
+            hi--;
+        bounds[0][c] = static_cast<std::uint8_t>(lo);
+        bounds[1][c] = static_cast<std::uint8_t>(hi);
+    }
+    std::uint_fast64_t weight = 0;
+    for (std::size_t value = 0; value < 256; value++)
+        weight += histograms[value];
+    Box box(begin, end, weight,
+            RGBPixel(bounds[0][0], bounds[0][1], bounds[0][2]),
+            RGBPixel(bounds[1][0], bounds[1][1], bounds[1][2]));
+
+    double bestGain = 0.0;
+    for (std::size_t c = 0; c < 3; c++) {
+        const std::size_t lo = bounds[0][c];
+        const std::size_t hi = bounds[1][c];
+        if (lo == hi)
+            continue;
+
+        const std::uint_fast64_t* buckets = histograms + c * 256;
+        double count = 0.0, sum = 0.0, squares = 0.0;
+        for (std::size_t value = lo; value <= hi; value++) {
+            count += buckets[value];
+            sum += static_cast<double>(buckets[value]) * value;
+            squares += static_cast<double>(buckets[value]) * value * value;
+        }
+        const double whole = sum * sum / count;
+        box.error += squares - whole;
+
+        double lowCount = 0.0, lowSum = 0.0;
+        for (std::size_t value = lo; value < hi; value++) {
+            lowCount += buckets[value];
+            lowSum += static_cast<double>(buckets[value]) * value;
+            if (buckets[value] == 0)
+                continue;
+            const double highSum = sum - lowSum;
+            const double gain = lowSum * lowSum / lowCount +
+                                highSum * highSum / (count - lowCount) - whole;
+            if (gain > bestGain) {
+                bestGain = gain;
+                box.channel = static_cast<Channel>(c);
+                box.cut = static_cast<std::int_fast32_t>(value + 1);
+            }
+        }
+    }
+    return box;
+}
+
+/*
+Creates a box over [begin, end) of data, measuring its bounds, or its
+histograms for the variance policy. Cells are few, so boxes of them are
+always handled on the calling thread
+*/
+template <typename T>
+Box makeBox(const std::vector<T>& data, const std::size_t begin,
+            const std::size_t end, const SplitPolicy policy, WorkerPool&) {
+    if (policy == SplitPolicy::Variance) {
+        std::uint_fast64_t histograms[3 * 256] = {0};
+        for (std::size_t i = begin; i < end; i++) {
+            const RGBPixel& p = colorOf(data[i]);
+            histograms[p.r] += weightOf(data[i]);
+            histograms[256 + p.g] += weightOf(data[i]);
+            histograms[2 * 256 + p.b] += weightOf(data[i]);
+        }
+        return varianceBox(begin, end, histograms);
+    }
+
+    RGBPixel lo;
+    RGBPixel hi;
+    std::uint_fast64_t weight;
+    measureBox(data.begin() + begin, data.begin() + end, lo, hi, weight);
+    return Box(begin, end, weight, lo, hi);
+}
+
+/*
+Creates a box over [begin, end) of planar pixels, measuring each plane in
+turn, or counting it for the variance policy. Large boxes are measured in
+chunks by every thread of the pool
+*/
+Box makeBox(const PlanarPixels& pixels, const std::size_t begin,
+            const std::size_t end, const SplitPolicy policy,
+            WorkerPool& pool) {
+    if (policy == SplitPolicy::Variance)
+        return varianceBox(begin, end,
+                           planarHistograms(pixels, begin, end, pool).data());
+
+    const PlaneKernels& kernels = planeKernels();
+    const std::size_t parts =
+        end - begin >= COOPERATIVE_MIN_PIXELS ? pool.size() : 1;
+
+    std::vector<RGBPixel> los(parts, RGBPixel(255, 255, 255));
+    std::vector<RGBPixel> his(parts, RGBPixel(0, 0, 0));
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(begin, end, parts, i, first, last);
+        kernels.bounds(pixels.red.get() + first, last - first, los[i].r,
+                       his[i].r);
+        kernels.bounds(pixels.green.get() + first, last - first, los[i].g,
+                       his[i].g);
+        kernels.bounds(pixels.blue.get() + first, last - first, los[i].b,
+                       his[i].b);
+    });
+
+    RGBPixel lo = los[0];
+    RGBPixel hi = his[0];
+    for (std::size_t i = 1; i < parts; i++) {
+        lo = RGBPixel(std::min(lo.r, los[i].r), std::min(lo.g, los[i].g),
+                      std::min(lo.b, los[i].b));
+        hi = RGBPixel(std::max(hi.r, his[i].r), std::max(hi.g, his[i].g),
+                      std::max(hi.b, his[i].b));
+    }
+    return Box(begin, end, end - begin, lo, hi);
+}
+
+/*
+Returns the member of RGBPixel that holds the given channel
+*/
+std::uint8_t RGBPixel::*channelMember(const Channel channel) {
+    if (channel == Channel::Red)
+        return &RGBPixel::r;
+    else if (channel == Channel::Green)
+        return &RGBPixel::g;
+    else
+        return &RGBPixel::b;
+}
+
+/*
+Given a weighted 256 bucket histogram of one channel of a box, finds the
+median value, and returns the value to cut below. The cut is placed either
+just below or just above the median, whichever leaves the halves closer to
+even, and the box must have a non-zero range along the channel, which
+guarantees both sides are non-empty
+*/
+std::uint_fast32_t findSplitPivot(const std::uint_fast64_t* buckets,
+                                  const std::uint_fast64_t total) {
+    std::uint_fast32_t median = 0;
+    std::uint_fast64_t below = 0;
+    while ((below + buckets[median]) * 2 < total) {
+        below += buckets[median];
+        median++;
+    }
+    const std::uint_fast64_t above = below + buckets[median];
+    if (below == 0 || (above < total && above * 2 - total < total - below * 2))
+        return median + 1;
+    return median;
+}
+
+/*
+Partitions a box in place around the weighted median of its widest channel,
+and returns the split point. Since the key is a single byte, the median
+comes from a histogram of the channel, so a split takes two linear passes
+and nothing gets sorted. Colors with the same value always land on the
+same side
+*/
+template <typename T>
+std::size_t splitBox(std::vector<T>& data, const Box& box, WorkerPool&) {
+    const std::uint8_t RGBPixel::*member = channelMember(box.channel);
+    typename std::vector<T>::iterator first = data.begin() + box.begin;
+    typename std::vector<T>::iterator last = data.begin() + box.end;
+
+    std::uint_fast64_t buckets[256] = {0};
+    std::uint_fast64_t total = 0;
+    for (typename std::vector<T>::iterator itr = first; itr != last; itr++) {
+        buckets[colorOf(*itr).*member] += weightOf(*itr);
+        total += weightOf(*itr);
+    }
+
+    const std::uint_fast32_t pivot =
+        box.cut >= 0 ? static_cast<std::uint_fast32_t>(box.cut)
+                     : findSplitPivot(buckets, total);
+    return std::partition(first, last,
+                          [&](const T& item) {
+                              return colorOf(item).*member < pivot;
+                          }) -
+           data.begin();
+}
+
+// offsets gathered per block while partitioning planar pixels
+const std::size_t PARTITION_BLOCK = 256;
+
+/*
+Partitions [begin, end) of planar pixels in place, so that the pixels whose
+key is below pivot come first, given that there are exactly mid - begin of
+them. The pixels on the wrong side of mid are gathered in blocks from both
+halves without branching on their values, and then swapped pairwise
+*/
+void partitionPlanes(PlanarPixels& pixels, const std::uint8_t* key,
+                     const std::size_t begin, const std::size_t mid,
+                     const std::size_t end, const std::uint_fast32_t pivot) {
+    std::uint8_t* red = pixels.red.get();
+    std::uint8_t* green = pixels.green.get();
+    std::uint8_t* blue = pixels.blue.get();
+
+    // both halves hold the same number of misplaced pixels
+    std::uint32_t leftOffsets[PARTITION_BLOCK];
+    std::uint32_t rightOffsets[PARTITION_BLOCK];
+    std::size_t left = begin, leftBase = 0;
+    std::size_t leftStart = 0, leftCount = 0;
+    std::size_t right = mid, rightBase = 0;
+    std::size_t rightStart = 0, rightCount = 0;
+    while (true) {
+        if (leftStart == leftCount) {
+            if (left >= mid)
+                break;
+            const std::size_t n = std::min(PARTITION_BLOCK, mid - left);
+            leftBase = left;
+            leftStart = leftCount = 0;
+            for (std::size_t k = 0; k < n; k++) {
+                leftOffsets[leftCount] = static_cast<std::uint32_t>(k);
+                leftCount += key[left + k] >= pivot;
+            }
+            left += n;
+            continue;
+        }
+        if (rightStart == rightCount) {
+            if (right >= end)
+                break;
+            const std::size_t n = std::min(PARTITION_BLOCK, end - right);
+            rightBase = right;
+            rightStart = rightCount = 0;
+            for (std::size_t k = 0; k < n; k++) {
+                rightOffsets[rightCount] = static_cast<std::uint32_t>(k);
+                rightCount += key[right + k] < pivot;
+            }
+            right += n;
+            continue;
+        }
+
+        const std::size_t n =
+            std::min(leftCount - leftStart, rightCount - rightStart);
+        for (std::size_t k = 0; k < n; k++) {
+            const std::size_t a = leftBase + leftOffsets[leftStart + k];
+            const std::size_t b = rightBase + rightOffsets[rightStart + k];
+            std::swap(red[a], red[b]);
+            std::swap(green[a], green[b]);
+            std::swap(blue[a], blue[b]);
+        }
+        leftStart += n;
+        rightStart += n;
+    }
+}
+
+/*
+Swaps every pixel in the given ranges of misplaced high pixels with one in
+the ranges of misplaced low pixels, starting from the offset-th misplaced
+pixel of each and stopping before the last-th
+*/
+void swapMisplaced(PlanarPixels& pixels,
+                   const std::vector<std::pair<std::size_t, std::size_t>>& high,
+                   const std::vector<std::pair<std::size_t, std::size_t>>& low,
+                   const std::size_t offset, const std::size_t last) {
+    std::uint8_t* red = pixels.red.get();
+    std::uint8_t* green = pixels.green.get();
+    std::uint8_t* blue = pixels.blue.get();
+
+    // find where the offset-th misplaced pixel sits in a list of ranges
+    auto seek = [offset](const std::vector<std::pair<std::size_t, std::size_t>>&
+                             ranges,
+                         std::size_t& range, std::size_t& pos) {
+        std::size_t skipped = 0;
+        range = 0;
+        while (skipped + ranges[range].second - ranges[range].first <=
+               offset) {
+            skipped += ranges[range].second - ranges[range].first;
+            range++;
+        }
+        pos = ranges[range].first + offset - skipped;
+    };
+
+    std::size_t highRange, highPos, lowRange, lowPos;
+    seek(high, highRange, highPos);
+    seek(low, lowRange, lowPos);
+    for (std::size_t k = offset; k < last; k++) {
+        std::swap(red[highPos], red[lowPos]);
+        std::swap(green[highPos], green[lowPos]);
+        std::swap(blue[highPos], blue[lowPos]);
+        if (++highPos == high[highRange].second && k + 1 < last)
+            highPos = high[++highRange].first;
+        if (++lowPos == low[lowRange].second && k + 1 < last)
+            lowPos = low[++lowRange].first;
+    }
+}
+
+/*
+Splits a box of planar pixels the same way, reading only the plane of the
+widest channel to find the median, and swapping across all three planes.
+The histogram already tells where the split point lands.
+
+Large boxes are split by every thread of the pool together. Each thread
+histograms and partitions its own chunk, which leaves every chunk with a
+low and a high part. The high parts left of the split point and the low
+parts right of it then hold the same number of pixels, and the threads
+swap even shares of them
+*/
+std::size_t splitBox(PlanarPixels& pixels, const Box& box, WorkerPool& pool) {
+    const std::uint8_t* key = pixels.plane(box.channel);
+    const std::size_t parts =
+        box.end - box.begin >= COOPERATIVE_MIN_PIXELS ? pool.size() : 1;
+
+    std::vector<std::array<std::uint_fast64_t, 256>> chunkBuckets(parts);
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(box.begin, box.end, parts, i, first, last);
+        planeHistogram(key + first, last - first, chunkBuckets[i].data());
+    });
+
+    std::uint_fast64_t buckets[256] = {0};
+    for (const std::array<std::uint_fast64_t, 256>& chunk : chunkBuckets)
+        for (std::size_t value = 0; value < 256; value++)
+            buckets[value] += chunk[value];
+    const std::uint_fast32_t pivot =
+        box.cut >= 0 ? static_cast<std::uint_fast32_t>(box.cut)
+                     : findSplitPivot(buckets, box.end - box.begin);
+
+    std::size_t mid = box.begin;
+    for (std::uint_fast32_t value = 0; value < pivot; value++)
+        mid += buckets[value];
+
+    std::vector<std::size_t> chunkMids(parts);
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(box.begin, box.end, parts, i, first, last);
+        chunkMids[i] = first;
+        for (std::uint_fast32_t value = 0; value < pivot; value++)
+            chunkMids[i] += chunkBuckets[i][value];
+        partitionPlanes(pixels, key, first, chunkMids[i], last, pivot);
+    });
+    if (parts == 1)
+        return mid;
+
+    std::vector<std::pair<std::size_t, std::size_t>> high;
+    std::vector<std::pair<std::size_t, std::size_t>> low;
+    std::size_t misplaced = 0;
+    for (std::size_t i = 0; i < parts; i++) {
+        std::size_t first, last;
+        chunkRange(box.begin, box.end, parts, i, first, last);
+        if (chunkMids[i] < mid && last > chunkMids[i]) {
+            high.push_back({chunkMids[i], std::min(last, mid)});
+            misplaced += high.back().second - high.back().first;
+        }
+        if (chunkMids[i] > mid && first < chunkMids[i])
+            low.push_back({std::max(first, mid), chunkMids[i]});
+    }
+
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(0, misplaced, parts, i, first, last);
+        if (first < last)
+            swapMisplaced(pixels, high, low, first, last);
+    });
+    return mid;
+}
+
+/*
+Linear light
+
+sRGB bytes are gamma encoded, so averaging them directly gives colors that
+are darker and muddier than the mix of light they stand for. Both
+directions of the conversion go through tables built at compile time, so
+that no pow() is ever called while quantizing
+*/
+
+/*
+Natural logarithm usable in constant expressions, for positive x. x is
+scaled into [0.5, 1) by powers of two, and the logarithm of what is left
+comes from the atanh series, which converges quickly there
+*/
+constexpr double constexprLog(double x) {
+    const double ln2 = 0.69314718055994530942;
+    double result = 0.0;
+    while (x < 0.5) {
+        x *= 2.0;
+        result -= ln2;
+    }
+    while (x >= 1.0) {
+        x /= 2.0;
+        result += ln2;
+    }
+    const double z = (x - 1.0) / (x + 1.0);
+    double term = z;
+    for (int i = 1; i < 60; i += 2) {
+        result += 2.0 * term / i;
+        term *= z * z;
+    }
+    return result;
+}
+
+/*
+Exponential usable in constant expressions. x is divided by 2^8 to make the
+Taylor series converge quickly, and the result is squared back up
+*/
+constexpr double constexprExp(const double x) {
+    const double reduced = x / 256.0;
+    double result = 1.0;
+    double term = 1.0;
+    for (int i = 1; i < 20; i++) {
+        term *= reduced / i;
+        result += term;
+    }
+    for (int i = 0; i < 8; i++)
+        result *= result;
+    return result;
+}
+
+/*
+Converts an sRGB value in [0, 1] to linear light
+*/
+constexpr double srgbToLinear(const double c) {
+    return c <= 0.04045 ? c / 12.92
+                        : constexprExp(2.4 * constexprLog((c + 0.055) / 1.055));
+}
+
+/*
+Builds the table that maps an 8-bit sRGB value to linear light
+*/
+constexpr std::array<float, 256> makeSrgbToLinearTable() {
+    std::array<float, 256> table{};
+    for (int i = 0; i < 256; i++)
+        table[i] = static_cast<float>(srgbToLinear(i / 255.0));
+    return table;
+}
+
+/*
+Builds the linear light values halfway between consecutive 8-bit sRGB
+values, at which rounding back to sRGB moves up by one
+*/
+constexpr std::array<float, 255> makeLinearThresholdTable() {
+    std::array<float, 255> table{};
+    for (int i = 0; i < 255; i++)
+        table[i] = static_cast<float>(srgbToLinear((i + 0.5) / 255.0));
+    return table;
+}
+
+constexpr std::array<float, 256> SRGB_TO_LINEAR = makeSrgbToLinearTable();
+constexpr std::array<float, 255> LINEAR_THRESHOLDS = makeLinearThresholdTable();
+
+/*
+Converts linear light back to the nearest 8-bit sRGB value, by searching
+the thresholds between consecutive values
+*/
+inline std::uint8_t linearToSrgb(const float linear) {
+    return static_cast<std::uint8_t>(
+        std::upper_bound(LINEAR_THRESHOLDS.begin(), LINEAR_THRESHOLDS.end(),
+                         linear) -
+        LINEAR_THRESHOLDS.begin());
+}
+
+/*
+Converts the sums of count colors, in linear light, to the mean color
+*/
+RGBPixel linearMean(const double redAccum, const double greenAccum,
+                    const double blueAccum, const double count) {
+    return RGBPixel(linearToSrgb(static_cast<float>(redAccum / count)),
+                    linearToSrgb(static_cast<float>(greenAccum / count)),
+                    linearToSrgb(static_cast<float>(blueAccum / count)));
+}
+
+/*
+The channel sums of the colors in a box, red first, either of the sRGB
+bytes or in linear light. Sums rather than means are kept, so that the
+sums of two boxes add up to those of the box they were split from
+*/
+typedef std::array<double, 3> ColorSums;
+
+/*
+Converts the sums of weight pixels to their mean color
+*/
+RGBPixel meanColor(const ColorSums& sums, const std::uint_fast64_t weight,
+                   const bool linear) {
+    const double count = static_cast<double>(weight);
+    if (linear)
+        return linearMean(sums[0], sums[1], sums[2], count);
+
+    // the byte sums are whole numbers well below 2^53, so dividing them
+    // as doubles truncates exactly as dividing them as integers would
+    return RGBPixel(static_cast<std::uint8_t>(sums[0] / count),
+                    static_cast<std::uint8_t>(sums[1] / count),
+                    static_cast<std::uint8_t>(sums[2] / count));
+}
+
+/*
+Sums the colors in a box, weighting each by the pixels it stands for,
+either straight on the sRGB bytes or in linear light
+*/
+template <typename T>
+ColorSums sumBox(const std::vector<T>& data, const Box& box, const bool linear,
+                 WorkerPool&) {
+    if (linear) {
+        double redAccum = 0.0;
+        double greenAccum = 0.0;
+        double blueAccum = 0.0;
+        std::for_each(data.begin() + box.begin, data.begin() + box.end,
+                      [&](const T& item) {
+                          const RGBPixel& p = colorOf(item);
+                          const double weight = weightOf(item);
+                          redAccum += SRGB_TO_LINEAR[p.r] * weight;
+                          greenAccum += SRGB_TO_LINEAR[p.g] * weight;
+                          blueAccum += SRGB_TO_LINEAR[p.b] * weight;
+                      });
+        return {redAccum, greenAccum, blueAccum};
+    }
+
+    std::uint_fast64_t redAccum = 0;
+    std::uint_fast64_t greenAccum = 0;
+    std::uint_fast64_t blueAccum = 0;
+    std::for_each(data.begin() + box.begin, data.begin() + box.end,
+                  [&](const T& item) {
+                      const RGBPixel& p = colorOf(item);
+                      const std::uint_fast64_t weight = weightOf(item);
+                      redAccum += p.r * weight;
+                      greenAccum += p.g * weight;
+                      blueAccum += p.b * weight;
+                  });
+    return {static_cast<double>(redAccum), static_cast<double>(greenAccum),
+            static_cast<double>(blueAccum)};
+}
+
+/*
+Sums a box of planar pixels in linear light. Rather than looking up every
+byte, each plane is counted into a histogram of its 256 values, and only
+the buckets are converted and weighted. Large boxes are counted in chunks
+by every thread of the pool
+*/
+ColorSums sumBoxLinear(const PlanarPixels& pixels, const Box& box,
+                       WorkerPool& pool) {
+    const std::array<std::uint_fast64_t, 3 * 256> histogram =
+        planarHistograms(pixels, box.begin, box.end, pool);
+
+    ColorSums accums = {0.0, 0.0, 0.0};
+    for (std::size_t c = 0; c < 3; c++)
+        for (std::size_t value = 0; value < 256; value++)
+            accums[c] += static_cast<double>(histogram[c * 256 + value]) *
+                         SRGB_TO_LINEAR[value];
+    return accums;
+}
+
+/*
+Sums a box of planar pixels, one plane at a time. Large boxes are summed
+in chunks by every thread of the pool
+*/
+ColorSums sumBox(const PlanarPixels& pixels, const Box& box, const bool linear,
+                 WorkerPool& pool) {
+    if (linear)
+        return sumBoxLinear(pixels, box, pool);
+
+    const PlaneKernels& kernels = planeKernels();
+    const std::size_t count = box.end - box.begin;
+    const std::size_t parts = count >= COOPERATIVE_MIN_PIXELS ? pool.size() : 1;
+
+    std::vector<std::array<std::uint_fast64_t, 3>> sums(parts);
+    pool.run(parts, [&](const std::size_t i) {
+        std::size_t first, last;
+        chunkRange(box.begin, box.end, parts, i, first, last);
+        sums[i][0] = kernels.sum(pixels.red.get() + first, last - first);
+        sums[i][1] = kernels.sum(pixels.green.get() + first, last - first);
+        sums[i][2] = kernels.sum(pixels.blue.get() + first, last - first);
+    });
+
+    std::uint_fast64_t redAccum = 0;
+    std::uint_fast64_t greenAccum = 0;
+    std::uint_fast64_t blueAccum = 0;
+    for (const std::array<std::uint_fast64_t, 3>& sum : sums) {
+        redAccum += sum[0];
+        greenAccum += sum[1];
+        blueAccum += sum[2];
+    }
+    return {static_cast<double>(redAccum), static_cast<double>(greenAccum),
+            static_cast<double>(blueAccum)};
+}
+
+/*
+A node of the palette tree stands for a box that median cut made, with the
+sums of its colors and the pixels they add up over. Nodes are numbered in
+the order they were made, so the children of the i-th split are nodes
+2i + 1 and 2i + 2, and a parent always comes before its children
+*/
+struct PaletteNode {
+    std::size_t begin;
+    std::uint_fast64_t weight;
+    ColorSums sums;
+    std::int_fast32_t parent;
+
+    PaletteNode(std::size_t _begin, std::uint_fast64_t _weight,
+                std::int_fast32_t _parent)
+        : begin(_begin), weight(_weight), sums({0.0, 0.0, 0.0}),
+          parent(_parent) {}
+};
+
+/*
+The split history of a median cut run. Replaying its first k - 1 splits
+gives the palette median cut would have picked for k colors, so a single
+run yields the palettes of every size up to the one it was run for
+*/
+struct PaletteTree {
+    std::vector<PaletteNode> nodes;
+    bool linear;
+
+    PaletteTree() : linear(false) {}
+
+    std::size_t splits() const { return nodes.size() / 2; }
+};
+
+/*
+Adapted from
+https://indiegamedev.net/2020/01/17/median-cut-with-floyd-steinberg-dithering-in-c/
+
+Boxes are ranges over data, which gets reordered in place as they are split,
+so no pixel is ever copied. Every split is recorded in the palette tree,
+and only the boxes left at the end are summed, with the sums of the boxes
+they were split from added up from them.
+
+Large boxes are split by every thread of the pool together. Once the widest
+box is small, it is split along with the next widest ones, one per thread,
+and the children of the boxes that are not next in line are kept until
+their parent comes up. Every box is split exactly as it would be with a
+single thread, and in the same order, so the palette does not depend on
+the number of threads
+*/
+template <typename Data>
+PaletteTree medianCut(Data& data, const std::uint_fast32_t numColors,
+                      const SplitPolicy policy, const bool linear,
+                      WorkerPool& pool) {
+    PaletteTree tree;
+    tree.linear = linear;
+    std::vector<Box> boxes;
+    if (data.size() == 0)
+        return tree;
+    boxes.reserve(numColors + pool.size());
+    boxes.push_back(makeBox(data, 0, data.size(), policy, pool));
+    boxes.back().node = 0;
+    tree.nodes.reserve(2 * numColors);
+    tree.nodes.push_back(PaletteNode(0, boxes.back().weight, -1));
+
+    // children of the boxes that have been split ahead of time
+    std::vector<std::pair<Box, Box>> splits;
+
+    // boxes is kept as a max-heap on the cached score, so picking the next
+    // box to split never rescans or resorts the others
+    while (boxes.size() < numColors) {
+        std::pop_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+        Box biggestBox = boxes.back();
+
+        // if even the widest box holds a single color, nothing is left to split
+        if (biggestBox.range == 0) {
+            std::push_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+            break;
+        }
+        boxes.pop_back();
+
+        if (biggestBox.split < 0) {
+            std::vector<Box> batch(1, biggestBox);
+            const std::size_t limit = std::min<std::size_t>(
+                pool.size(), numColors - boxes.size() - 1);
+            while (biggestBox.end - biggestBox.begin < COOPERATIVE_MIN_PIXELS &&
+                   batch.size() < limit && !boxes.empty()) {
+                std::pop_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+                const Box& next = boxes.back();
+                if (next.range == 0 || next.split >= 0 ||
+                    next.end - next.begin >= COOPERATIVE_MIN_PIXELS) {
+                    std::push_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+                    break;
+                }
+                batch.push_back(next);
+                boxes.pop_back();
+            }
+
+            std::vector<Box> lower(batch.size(), biggestBox);
+            std::vector<Box> upper(batch.size(), biggestBox);
+            pool.run(batch.size(), [&](const std::size_t i) {
+                std::size_t mid = splitBox(data, batch[i], pool);
+                lower[i] = makeBox(data, batch[i].begin, mid, policy, pool);
+                upper[i] = makeBox(data, mid, batch[i].end, policy, pool);
+            });
+
+            for (std::size_t i = 0; i < batch.size(); i++) {
+                batch[i].split = static_cast<std::int_fast32_t>(splits.size());
+                splits.push_back({lower[i], upper[i]});
+            }
+            for (std::size_t i = 1; i < batch.size(); i++) {
+                boxes.push_back(batch[i]);
+                std::push_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+            }
+            biggestBox = batch[0];
+        }
+
+        // the children only become nodes once their parent is split in turn
+        for (Box child : {splits[biggestBox.split].first,
+                          splits[biggestBox.split].second}) {
+            child.node = static_cast<std::int_fast32_t>(tree.nodes.size());
+            tree.nodes.push_back(
+                PaletteNode(child.begin, child.weight, biggestBox.node));
+            boxes.push_back(child);
+            std::push_heap(boxes.begin(), boxes.end(), cmpBoxScore);
+        }
+    }
+
+    // each box in boxes can be summed on its own, with the large ones summed
+    // by every thread together, and the rest as tasks
+    std::vector<std::size_t> smallBoxes;
+    for (std::size_t i = 0; i < boxes.size(); i++) {
+        if (boxes[i].end - boxes[i].begin >= COOPERATIVE_MIN_PIXELS)
+            tree.nodes[boxes[i].node].sums =
+                sumBox(data, boxes[i], linear, pool);
+        else
+            smallBoxes.push_back(i);
+    }
+    pool.run(smallBoxes.size(), [&](const std::size_t i) {
+        const Box& box = boxes[smallBoxes[i]];
+        tree.nodes[box.node].sums = sumBox(data, box, linear, pool);
+    });
+
+    // children come after their parent, so walking the nodes backwards
+    // adds every subtree up before its root is added to its own parent
+    for (std::size_t i = tree.nodes.size() - 1; i > 0; i--)
+        for (std::size_t c = 0; c < 3; c++)
+            tree.nodes[tree.nodes[i].parent].sums[c] += tree.nodes[i].sums[c];
+    return tree;
+}
+
+/*
+Returns how much the i-th split of a palette tree lowers the squared error
+of the image, per pixel, with the colors of its boxes as bytes. Splitting
+a box of weight n into boxes of weights a and b, with means ma and mb,
+lowers its squared error by exactly a * b / n * |ma - mb|^2
+*/
+double splitGain(const PaletteTree& tree, const std::size_t split) {
+    const PaletteNode& lower = tree.nodes[2 * split + 1];
+    const PaletteNode& upper = tree.nodes[2 * split + 2];
+    const RGBPixel a = meanColor(lower.sums, lower.weight, tree.linear);
+    const RGBPixel b = meanColor(upper.sums, upper.weight, tree.linear);
+    const double dr = static_cast<double>(a.r) - b.r;
+    const double dg = static_cast<double>(a.g) - b.g;
+    const double db = static_cast<double>(a.b) - b.b;
+    const double lowerWeight = static_cast<double>(lower.weight);
+    const double upperWeight = static_cast<double>(upper.weight);
+    return lowerWeight * upperWeight / (lowerWeight + upperWeight) *
+           (dr * dr + dg * dg + db * db) / tree.nodes[0].weight;
+}
+
+/*
+Returns how many colors a palette tree is worth splitting into, which is
+up to and including the last split that still lowers the squared error of
+the image by at least minGain per pixel. Median cut does not split boxes
+in the order of their gains, so a single poor split does not end the
+palette while better ones are still to come
+*/
+std::uint_fast32_t treeColors(const PaletteTree& tree, const float minGain) {
+    std::size_t splits = tree.splits();
+    while (splits > 0 && splitGain(tree, splits - 1) < minGain)
+        splits--;
+    return static_cast<std::uint_fast32_t>(splits + 1);
+}
+
+/*
+Replays the first numColors - 1 splits of a palette tree, and returns the
+mean colors of the boxes they leave, weighted by their pixels, in buffer
+order like a median cut run for numColors colors would
+*/
+std::vector<WeightedColor> treePalette(const PaletteTree& tree,
+                                       const std::uint_fast32_t numColors) {
+    if (tree.nodes.empty() || numColors == 0)
+        return {};
+    const std::size_t splits =
+        std::min<std::size_t>(numColors - 1, tree.splits());
+    const std::size_t count = 2 * splits + 1;
+
+    std::vector<bool> isSplit(count, false);
+    for (std::size_t i = 1; i < count; i++)
+        isSplit[tree.nodes[i].parent] = true;
+
+    std::vector<const PaletteNode*> leaves;
+    for (std::size_t i = 0; i < count; i++)
+        if (!isSplit[i])
+            leaves.push_back(&tree.nodes[i]);
+    std::sort(leaves.begin(), leaves.end(),
+              [](const PaletteNode* a, const PaletteNode* b) {
+                  return a->begin < b->begin;
+              });
+
+    std::vector<WeightedColor> palette;
+    for (const PaletteNode* leaf : leaves)
+        palette.push_back(WeightedColor(
+            meanColor(leaf->sums, leaf->weight, tree.linear), leaf->weight));
+    return palette;
+}
+
+/*
+Runs median cut over every pixel of the image, on a planar copy of the
+pixels, up to numColors colors, averaging the boxes in linear light if
+asked to
+*/
+PaletteTree medianCutBuildTree(const PixelView& source,
+                               const std::uint_fast32_t numColors,
+                               const SplitPolicy policy, const bool linear,
+                               WorkerPool& pool) {
+    PlanarPixels pixels = deinterleavePixels(source);
+    return medianCut(pixels, numColors, policy, linear, pool);
+}
+
+/*
+Builds a 3D color histogram in a single pass over the pixels, and returns
+every occupied cell as the mean color of the pixels that fell in it, weighted
+by how many pixels that was
+*/
+std::vector<WeightedColor>
+buildColorHistogram(const PixelView& source) {
+    const std::uint_fast32_t shift = 8 - HISTOGRAM_BITS;
+    const std::uint_fast32_t side = 1 << HISTOGRAM_BITS;
+
+    struct Cell {
+        std::uint_fast64_t redAccum = 0;
+        std::uint_fast64_t greenAccum = 0;
+        std::uint_fast64_t blueAccum = 0;
+        std::uint_fast32_t count = 0;
+    };
+    std::vector<Cell> cells(side * side * side);
+
+    for (const RGBPixel& p : source) {
+        Cell& cell = cells[((p.r >> shift) * side + (p.g >> shift)) * side +
+                           (p.b >> shift)];
+        cell.redAccum += p.r;
+        cell.greenAccum += p.g;
+        cell.blueAccum += p.b;
+        cell.count++;
+    }
+
+    std::vector<WeightedColor> histogram;
+    for (const Cell& cell : cells) {
+        if (cell.count == 0)
+            continue;
+        histogram.push_back(WeightedColor(
+            RGBPixel(static_cast<std::uint8_t>(cell.redAccum / cell.count),
+                     static_cast<std::uint8_t>(cell.greenAccum / cell.count),
+                     static_cast<std::uint8_t>(cell.blueAccum / cell.count)),
+            cell.count));
+    }
+    return histogram;
+}
+
+/*
+Unique colors
+
+Screenshots, illustrations and logos often hold a few thousand distinct
+colors across millions of pixels. Collapsing the pixels into their unique
+colors, each weighted by how many pixels have it, lets median cut run over
+those rather than over every pixel, and pick exactly the same palette.
+Photos are told apart by a sample first, and counting gives up as soon as
+there are too many colors for it to pay off
+*/
+
+// images with at least this many pixels are counted in a table with a slot
+// for every 24-bit color, smaller ones in a hash table sized to the limit
+const std::size_t DIRECT_COUNT_MIN_PIXELS = 1 << 22;
+
+// unique colors only pay off with at most one of them per this many pixels
+const std::size_t UNIQUE_COLOR_RATIO = 16;
+
+// pixels sampled to tell whether an image is worth counting at all
+const std::size_t UNIQUE_SAMPLE_SIZE = 1 << 14;
+
+inline std::uint32_t packColor(const RGBPixel& p) {
+    return (std::uint32_t(p.r) << 16) | (std::uint32_t(p.g) << 8) | p.b;
+}
+
+inline RGBPixel unpackColor(const std::uint32_t key) {
+    return RGBPixel(static_cast<std::uint8_t>(key >> 16),
+                    static_cast<std::uint8_t>(key >> 8),
+                    static_cast<std::uint8_t>(key));
+}
+
+/*
+Returns the length of the run of pixels with the same color as the one at
+first, up to last
+*/
+inline std::size_t colorRun(const PixelView& source,
+                            const std::size_t first, const std::size_t last) {
+    const std::uint32_t key = packColor(source[first]);
+    std::size_t i = first + 1;
+    while (i < last && packColor(source[i]) == key)
+        i++;
+    return i - first;
+}
+
+/*
+Counts colors in a zeroed table indexed by the packed color itself, a run
+of equal pixels at a time, and keeps the colors in the order they were
+first seen. The table is left to calloc, so only the pages that colors land
+in are ever touched
+*/
+bool directCountColors(const PixelView& source,
+                       const std::size_t limit,
+                       std::vector<WeightedColor>& colors) {
+    std::unique_ptr<std::uint32_t[], AlignedFree> counts(
+        static_cast<std::uint32_t*>(
+            std::calloc(std::size_t(1) << 24, sizeof(std::uint32_t))));
+    if (counts == nullptr)
+        throw std::bad_alloc();
+
+    std::vector<std::uint32_t> keys;
+    for (std::size_t i = 0; i < source.size();) {
+        const std::uint32_t key = packColor(source[i]);
+        const std::size_t run = colorRun(source, i, source.size());
+        if (counts[key] == 0) {
+            if (keys.size() == limit)
+                return false;
+            keys.push_back(key);
+        }
+        counts[key] += static_cast<std::uint32_t>(run);
+        i += run;
+    }
+
+    colors.clear();
+    colors.reserve(keys.size());
+    for (const std::uint32_t key : keys)
+        colors.push_back(WeightedColor(unpackColor(key), counts[key]));
+    return true;
+}
+
+/*
+Counts colors in an open addressing hash table with linear probing, big
+enough to hold limit colors at most half full, a run of equal pixels at a
+time
+*/
+bool hashCountColors(const PixelView& source,
+                     const std::size_t limit,
+                     std::vector<WeightedColor>& colors) {
+    const std::uint32_t empty = 0xffffffff;
+    std::uint32_t bits = 10;
+    while ((std::size_t(1) << bits) < limit * 2)
+        bits++;
+    const std::size_t mask = (std::size_t(1) << bits) - 1;
+    std::vector<std::uint32_t> keys(mask + 1, empty);
+    std::vector<std::uint32_t> counts(mask + 1, 0);
+
+    std::size_t unique = 0;
+    for (std::size_t i = 0; i < source.size();) {
+        const std::uint32_t key = packColor(source[i]);
+        const std::size_t run = colorRun(source, i, source.size());
+        std::size_t slot = (key * 0x9e3779b1u) >> (32 - bits);
+        while (keys[slot] != key && keys[slot] != empty)
+            slot = (slot + 1) & mask;
+        if (keys[slot] == empty) {
+            if (unique == limit)
+                return false;
+            keys[slot] = key;
+            unique++;
+        }
+        counts[slot] += static_cast<std::uint32_t>(run);
+        i += run;
+    }
+
+    colors.clear();
+    colors.reserve(unique);
+    for (std::size_t slot = 0; slot <= mask; slot++)
+        if (keys[slot] != empty)
+            colors.push_back(WeightedColor(unpackColor(keys[slot]),
+                                           counts[slot]));
+    return true;
+}
+
+/*
+Collapses the pixels into their unique colors and how many pixels have
+each, picking the table by the size of the image. Returns false, leaving
+colors alone, if the image has too many colors for that to pay off, which
+is first checked on an evenly spaced sample of the pixels, where most
+photos already show at least three in four colors distinct
+*/
+bool findUniqueColors(const PixelView& source,
+                      std::vector<WeightedColor>& colors) {
+    const std::size_t limit = source.size() / UNIQUE_COLOR_RATIO;
+    if (limit == 0)
+        return false;
+
+    if (source.size() >= UNIQUE_SAMPLE_SIZE * UNIQUE_COLOR_RATIO) {
+        const std::size_t stride = source.size() / UNIQUE_SAMPLE_SIZE;
+        std::vector<RGBPixel> sample(UNIQUE_SAMPLE_SIZE);
+        for (std::size_t i = 0; i < UNIQUE_SAMPLE_SIZE; i++)
+            sample[i] = source[i * stride];
+        std::vector<WeightedColor> sampleColors;
+        if (!hashCountColors(PixelView(sample), UNIQUE_SAMPLE_SIZE * 3 / 4,
+                             sampleColors))
+            return false;
+    }
+
+    if (source.size() >= DIRECT_COUNT_MIN_PIXELS)
+        return directCountColors(source, limit, colors);
+    return hashCountColors(source, limit, colors);
+}
+
+/*
+Distinct colors
+
+An image with no more distinct colors than the palette holds needs no
+quantizing at all, its colors are the palette. One bit for each of the
+2^24 colors, 2 MB in all, is enough to count them while the image loads,
+and tracking stops as soon as there are too many
+*/
+struct DistinctColors {
+    std::vector<std::uint64_t> seen;
+    std::vector<RGBPixel> colors;
+    std::size_t limit;
+    bool overflowed;
+
+    explicit DistinctColors(const std::size_t _limit)
+        : seen((std::size_t(1) << 24) / 64, 0), limit(_limit),
+          overflowed(false) {}
+
+    /*
+    Records a color, and returns false once there have been more than limit
+    distinct ones, after which nothing is recorded any more
+    */
+    bool insert(const RGBPixel& p) {
+        const std::uint32_t key = packColor(p);
+        std::uint64_t& word = seen[key / 64];
+        const std::uint64_t bit = std::uint64_t(1) << (key % 64);
+        if (word & bit)
+            return true;
+        if (colors.size() == limit) {
+            overflowed = true;
+            return false;
+        }
+        word |= bit;
+        colors.push_back(p);
+        return true;
+    }
+};
+
+/*
+Counts the pixels of each of a handful of distinct colors, and returns them
+from the most to the least common
+*/
+std::vector<WeightedColor>
+countDistinctColors(const PixelView& source,
+                    const std::vector<RGBPixel>& colors) {
+    std::vector<WeightedColor> counted;
+    for (const RGBPixel& color : colors)
+        counted.push_back(WeightedColor(color, 0));
+
+    std::size_t last = 0;
+    for (std::size_t i = 0; i < source.size();) {
+        const std::uint32_t key = packColor(source[i]);
+        const std::size_t run = colorRun(source, i, source.size());
+        while (packColor(counted[last].color) != key)
+            last = (last + 1) % counted.size();
+        counted[last].count += run;
+        i += run;
+    }
+
+    std::stable_sort(counted.begin(), counted.end(),
+                     [](const WeightedColor& a, const WeightedColor& b) {
+                         return a.count > b.count;
+                     });
+    return counted;
+}
+
+/*
+Median cut over weighted colors, either histogram cells or unique colors,
+where each counts as many pixels as it stands for. The cost depends on the
+number of colors rather than the number of pixels in the image
+*/
+PaletteTree weightedMedianCutBuildTree(std::vector<WeightedColor> source,
+                                       const std::uint_fast32_t numColors,
+                                       const SplitPolicy policy,
+                                       const bool linear, WorkerPool& pool) {
+    return medianCut(source, numColors, policy, linear, pool);
+}
+
+/*
+Xiaolin Wu's variance minimizing quantizer, from Graphics Gems II
+
+The color space is cut into 32x32x32 cells, and cumulative moment tables of
+the pixel count, channel sums and sum of squares are built over them. The
+moments of any box, and so its variance, then come from a constant number
+of table lookups, whatever the resolution of the image
+*/
+
+// 32 cells per channel, plus a plane of zeros for the cumulative sums
+const int WU_SIDE = 33;
+
+struct WuMoments {
+    std::vector<std::int_fast64_t> weight;
+    std::vector<std::int_fast64_t> red;
+    std::vector<std::int_fast64_t> green;
+    std::vector<std::int_fast64_t> blue;
+    std::vector<double> squares;
+};
+
+/*
+A box of cells, where the lower bounds are exclusive and the upper bounds
+are inclusive
+*/
+struct WuBox {
+    int r0, r1;
+    int g0, g1;
+    int b0, b1;
+};
+
+inline std::size_t wuIndex(const int r, const int g, const int b) {
+    return (static_cast<std::size_t>(r) * WU_SIDE + g) * WU_SIDE + b;
+}
+
+/*
+Builds the histogram of every moment, then turns each table into its
+cumulative sum, so that cell (r, g, b) holds the moments of the whole box
+from the origin up to it. Works on pixels or on weighted colors
+*/
+template <typename Data>
+WuMoments buildWuMoments(const Data& source) {
+    const std::size_t size = WU_SIDE * WU_SIDE * WU_SIDE;
+    WuMoments m;
+    m.weight.assign(size, 0);
+    m.red.assign(size, 0);
+    m.green.assign(size, 0);
+    m.blue.assign(size, 0);
+    m.squares.assign(size, 0.0);
+
+    for (const auto& item : source) {
+        const RGBPixel& p = colorOf(item);
+        const std::uint_fast32_t weight = weightOf(item);
+        std::size_t ind =
+            wuIndex((p.r >> 3) + 1, (p.g >> 3) + 1, (p.b >> 3) + 1);
+        m.weight[ind] += weight;
+        m.red[ind] += p.r * weight;
+        m.green[ind] += p.g * weight;
+        m.blue[ind] += p.b * weight;
+        m.squares[ind] +=
+            static_cast<double>(p.r * p.r + p.g * p.g + p.b * p.b) * weight;
+    }
+
+    for (int r = 1; r < WU_SIDE; r++) {
+        std::int_fast64_t areaW[WU_SIDE] = {0};
+        std::int_fast64_t areaR[WU_SIDE] = {0};
+        std::int_fast64_t areaG[WU_SIDE] = {0};
+        std::int_fast64_t areaB[WU_SIDE] = {0};
+        double areaS[WU_SIDE] = {0.0};
+
+        for (int g = 1; g < WU_SIDE; g++) {
+            std::int_fast64_t lineW = 0, lineR = 0, lineG = 0, lineB = 0;
+            double lineS = 0.0;
+
+            for (int b = 1; b < WU_SIDE; b++) {
+                std::size_t ind = wuIndex(r, g, b);
+                std::size_t prev = wuIndex(r - 1, g, b);
+
+                lineW += m.weight[ind];
+                lineR += m.red[ind];
+                lineG += m.green[ind];
+                lineB += m.blue[ind];
+                lineS += m.squares[ind];
+
+                areaW[b] += lineW;
+                areaR[b] += lineR;
+                areaG[b] += lineG;
+                areaB[b] += lineB;
+                areaS[b] += lineS;
+
+                m.weight[ind] = m.weight[prev] + areaW[b];
+                m.red[ind] = m.red[prev] + areaR[b];
+                m.green[ind] = m.green[prev] + areaG[b];
+                m.blue[ind] = m.blue[prev] + areaB[b];
+                m.squares[ind] = m.squares[prev] + areaS[b];
+            }
+        }
+    }
+    return m;
+}
+
+/*
+Sums a moment over a whole box
+*/
+template <typename M>
+M wuVolume(const WuBox& box, const std::vector<M>& m) {
+    return m[wuIndex(box.r1, box.g1, box.b1)] -
+           m[wuIndex(box.r1, box.g1, box.b0)] -
+           m[wuIndex(box.r1, box.g0, box.b1)] +
+           m[wuIndex(box.r1, box.g0, box.b0)] -
+           m[wuIndex(box.r0, box.g1, box.b1)] +
+           m[wuIndex(box.r0, box.g1, box.b0)] +
+           m[wuIndex(box.r0, box.g0, box.b1)] -
+           m[wuIndex(box.r0, box.g0, box.b0)];
+}
+
+/*
+The part of a box's volume that does not depend on where it is cut along
+the given channel
+*/
+template <typename M>
+M wuBottom(const WuBox& box, const Channel channel, const std::vector<M>& m) {
+    if (channel == Channel::Red)
+        return -m[wuIndex(box.r0, box.g1, box.b1)] +
+               m[wuIndex(box.r0, box.g1, box.b0)] +
+               m[wuIndex(box.r0, box.g0, box.b1)] -
+               m[wuIndex(box.r0, box.g0, box.b0)];
+    else if (channel == Channel::Green)
+        return -m[wuIndex(box.r1, box.g0, box.b1)] +
+               m[wuIndex(box.r1, box.g0, box.b0)] +
+               m[wuIndex(box.r0, box.g0, box.b1)] -
+               m[wuIndex(box.r0, box.g0, box.b0)];
+    else
+        return -m[wuIndex(box.r1, box.g1, box.b0)] +
+               m[wuIndex(box.r1, box.g0, box.b0)] +
+               m[wuIndex(box.r0, box.g1, box.b0)] -
+               m[wuIndex(box.r0, box.g0, box.b0)];
+}
+
+/*
+The rest of a box's volume when it is cut at pos along the given channel
+*/
+template <typename M>
+M wuTop(const WuBox& box, const Channel channel, const int pos,
+        const std::vector<M>& m) {
+    if (channel == Channel::Red)
+        return m[wuIndex(pos, box.g1, box.b1)] -
+               m[wuIndex(pos, box.g1, box.b0)] -
+               m[wuIndex(pos, box.g0, box.b1)] +
+               m[wuIndex(pos, box.g0, box.b0)];
+    else if (channel == Channel::Green)
+        return m[wuIndex(box.r1, pos, box.b1)] -
+               m[wuIndex(box.r1, pos, box.b0)] -
+               m[wuIndex(box.r0, pos, box.b1)] +
+               m[wuIndex(box.r0, pos, box.b0)];
+    else
+        return m[wuIndex(box.r1, box.g1, pos)] -
+               m[wuIndex(box.r1, box.g0, pos)] -
+               m[wuIndex(box.r0, box.g1, pos)] +
+               m[wuIndex(box.r0, box.g0, pos)];
+}
+
+/*
+Weighted variance of the colors in a box
+*/
+double wuVariance(const WuBox& box, const WuMoments& m) {
+    double dr = static_cast<double>(wuVolume(box, m.red));
+    double dg = static_cast<double>(wuVolume(box, m.green));
+    double db = static_cast<double>(wuVolume(box, m.blue));
+    double xx = wuVolume(box, m.squares);
+    return xx -
+           (dr * dr + dg * dg + db * db) /
+               static_cast<double>(wuVolume(box, m.weight));
+}
+
+/*
+Finds the cut along the given channel that leaves the two halves with the
+least total variance. Returns the score of the best cut, and sets cut to
+its position, or -1 if no cut leaves both halves non-empty
+*/
+double wuMaximize(const WuBox& box, const Channel channel, const int first,
+                  const int last, int& cut, const WuMoments& m,
+                  const std::int_fast64_t wholeR,
+                  const std::int_fast64_t wholeG,
+                  const std::int_fast64_t wholeB,
+                  const std::int_fast64_t wholeW) {
+    std::int_fast64_t baseR = wuBottom(box, channel, m.red);
+    std::int_fast64_t baseG = wuBottom(box, channel, m.green);
+    std::int_fast64_t baseB = wuBottom(box, channel, m.blue);
+    std::int_fast64_t baseW = wuBottom(box, channel, m.weight);
+
+    double max = 0.0;
+    cut = -1;
+    for (int i = first; i < last; i++) {
+        std::int_fast64_t halfR = baseR + wuTop(box, channel, i, m.red);
+        std::int_fast64_t halfG = baseG + wuTop(box, channel, i, m.green);
+        std::int_fast64_t halfB = baseB + wuTop(box, channel, i, m.blue);
+        std::int_fast64_t halfW = baseW + wuTop(box, channel, i, m.weight);
+        if (halfW == 0)
+            continue;
+
+        double temp = (static_cast<double>(halfR) * halfR +
+                       static_cast<double>(halfG) * halfG +
+                       static_cast<double>(halfB) * halfB) /
+                      halfW;
+
+        halfR = wholeR - halfR;
+        halfG = wholeG - halfG;
+        halfB = wholeB - halfB;
+        halfW = wholeW - halfW;
+        if (halfW == 0)
+            continue;
+
+        temp += (static_cast<double>(halfR) * halfR +
+                 static_cast<double>(halfG) * halfG +
+                 static_cast<double>(halfB) * halfB) /
+                halfW;
+
+        if (temp > max) {
+            max = temp;
+            cut = i;
+        }
+    }
+    return max;
+}
+
+/*
+Cuts box a in two along whichever channel reduces the variance the most,
+leaving one half in a and the other in b. Returns false if the box cannot
+be cut
+*/
+bool wuCut(WuBox& a, WuBox& b, const WuMoments& m) {
+    std::int_fast64_t wholeR = wuVolume(a, m.red);
+    std::int_fast64_t wholeG = wuVolume(a, m.green);
+    std::int_fast64_t wholeB = wuVolume(a, m.blue);
+    std::int_fast64_t wholeW = wuVolume(a, m.weight);
+
+    int cutR, cutG, cutB;
+    double maxR = wuMaximize(a, Channel::Red, a.r0 + 1, a.r1, cutR, m, wholeR,
+                             wholeG, wholeB, wholeW);
+    double maxG = wuMaximize(a, Channel::Green, a.g0 + 1, a.g1, cutG, m,
+                             wholeR, wholeG, wholeB, wholeW);
+    double maxB = wuMaximize(a, Channel::Blue, a.b0 + 1, a.b1, cutB, m, wholeR,
+                             wholeG, wholeB, wholeW);
+
+    b = a;
+    if (maxR >= maxG && maxR >= maxB) {
+        if (cutR < 0)
+            return false;
+        a.r1 = cutR;
+        b.r0 = cutR;
+    } else if (maxG >= maxR && maxG >= maxB) {
+        a.g1 = cutG;
+        b.g0 = cutG;
+    } else {
+        a.b1 = cutB;
+        b.b0 = cutB;
+    }
+    return true;
+}
+
+/*
+Generates a palette with Wu's quantizer, always cutting the box with the
+largest variance next
+*/
+template <typename Data>
+std::vector<WeightedColor>
+wuGeneratePalette(const Data& source, const std::uint_fast32_t numColors) {
+    if (source.empty() || numColors == 0)
+        return {};
+
+    WuMoments m = buildWuMoments(source);
+
+    std::vector<WuBox> boxes(numColors);
+    std::vector<double> variances(numColors, 0.0);
+    boxes[0] = {0, WU_SIDE - 1, 0, WU_SIDE - 1, 0, WU_SIDE - 1};
+
+    // a box holding a single cell cannot be cut any further
+    auto variance = [&](const WuBox& box) {
+        const int cells =
+            (box.r1 - box.r0) * (box.g1 - box.g0) * (box.b1 - box.b0);
+        return cells > 1 ? wuVariance(box, m) : 0.0;
+    };
+
+    std::size_t count = 1;
+    std::size_t next = 0;
+    while (count < numColors) {
+        if (wuCut(boxes[next], boxes[count], m)) {
+            variances[next] = variance(boxes[next]);
+            variances[count] = variance(boxes[count]);
+            count++;
+        } else {
+            variances[next] = 0.0;
+        }
+
+        next = std::max_element(variances.begin(), variances.begin() + count) -
+               variances.begin();
+        if (variances[next] <= 0.0)
+            break;
+    }
+
+    std::vector<WeightedColor> palette;
+    for (std::size_t i = 0; i < count; i++) {
+        std::int_fast64_t weight = wuVolume(boxes[i], m.weight);
+        if (weight == 0)
+            continue;
+        palette.push_back(WeightedColor(
+            RGBPixel(
+                static_cast<std::uint8_t>(wuVolume(boxes[i], m.red) / weight),
+                static_cast<std::uint8_t>(wuVolume(boxes[i], m.green) / weight),
+                static_cast<std::uint8_t>(wuVolume(boxes[i], m.blue) / weight)),
+            static_cast<std::uint_fast32_t>(weight)));
+    }
+    return palette;
+}
+
+/*
+Octree quantizer
+
+Pixels are inserted into an octree one at a time, with every level of the
+tree taking one more bit of each channel. Whenever there are more leaves
+than the budget allows, the children of the least populated node on the
+deepest level that has any are merged into it. The pixel buffer is never
+sorted nor copied, and all of the nodes come from a pool that is allocated
+once, up front
+*/
+
+const int OCTREE_DEPTH = 8;
+
+// leaves kept while streaming pixels in, before the final reduction
+const std::uint_fast32_t OCTREE_MAX_LEAVES = 512;
+
+struct OctreeNode {
+    std::uint_fast64_t redAccum;
+    std::uint_fast64_t greenAccum;
+    std::uint_fast64_t blueAccum;
+    std::uint_fast64_t count;
+    std::int32_t children[8];
+    // next node on the same reducible list, or on the free list
+    std::int32_t next;
+    bool leaf;
+};
+
+/*
+Every leaf has at most OCTREE_DEPTH ancestors, and every inner node has a
+leaf below it, so the pool never needs more than (OCTREE_DEPTH + 1) nodes
+per leaf, counting the one being inserted past the budget
+*/
+struct Octree {
+    std::vector<OctreeNode> pool;
+    std::int32_t freeList;
+    std::int32_t reducible[OCTREE_DEPTH];
+    std::uint_fast32_t leafCount;
+
+    explicit Octree(const std::uint_fast32_t maxLeaves)
+        : pool((maxLeaves + 1) * (OCTREE_DEPTH + 1) + 1), freeList(-1),
+          leafCount(0) {
+        for (std::int32_t i = static_cast<std::int32_t>(pool.size()) - 1;
+             i >= 0; i--) {
+            pool[i].next = freeList;
+            freeList = i;
+        }
+        std::fill(std::begin(reducible), std::end(reducible), -1);
+    }
+};
+
+/*
+Takes a blank node from the pool, and returns its index
+*/
+std::int32_t allocateOctreeNode(Octree& tree, const bool leaf) {
+    std::int32_t idx = tree.freeList;
+    OctreeNode& node = tree.pool[idx];
+    tree.freeList = node.next;
+
+    node.redAccum = 0;
+    node.greenAccum = 0;
+    node.blueAccum = 0;
+    node.count = 0;
+    std::fill(std::begin(node.children), std::end(node.children), -1);
+    node.next = -1;
+    node.leaf = leaf;
+    return idx;
+}
+
+/*
+Returns a node to the pool
+*/
+void freeOctreeNode(Octree& tree, const std::int32_t idx) {
+    tree.pool[idx].count = 0;
+    tree.pool[idx].leaf = false;
+    tree.pool[idx].next = tree.freeList;
+    tree.freeList = idx;
+}
+
+/*
+Adds a color standing for weight pixels to the tree, creating the nodes
+along its path that do not exist yet. Inner nodes are put on the reducible
+list of their level
+*/
+void insertOctree(Octree& tree, const std::int32_t root, const RGBPixel& p,
+                  const std::uint_fast32_t weight) {
+    std::int32_t idx = root;
+    for (int level = 0; !tree.pool[idx].leaf; level++) {
+        const int shift = 7 - level;
+        const int child = (((p.r >> shift) & 1) << 2) |
+                          (((p.g >> shift) & 1) << 1) | ((p.b >> shift) & 1);
+
+        if (tree.pool[idx].children[child] < 0) {
+            const bool leaf = level + 1 == OCTREE_DEPTH;
+            std::int32_t created = allocateOctreeNode(tree, leaf);
+            if (leaf) {
+                tree.leafCount++;
+            } else {
+                tree.pool[created].next = tree.reducible[level + 1];
+                tree.reducible[level + 1] = created;
+            }
+            tree.pool[idx].children[child] = created;
+        }
+        idx = tree.pool[idx].children[child];
+    }
+
+    OctreeNode& node = tree.pool[idx];
+    node.redAccum += p.r * weight;
+    node.greenAccum += p.g * weight;
+    node.blueAccum += p.b * weight;
+    node.count += weight;
+}
+
+/*
+Tells whether a node is a leaf with no children of its own, which can be
+merged into its parent without losing any leaves below it
+*/
+bool isBareOctreeLeaf(const Octree& tree, const std::int32_t idx) {
+    const OctreeNode& node = tree.pool[idx];
+    return node.leaf && std::all_of(std::begin(node.children),
+                                    std::end(node.children),
+                                    [](const std::int32_t c) { return c < 0; });
+}
+
+/*
+Merges the bare leaf children of a node into it, making it a leaf. When
+merging all of them would leave fewer than minLeaves leaves, only the least
+populated ones are merged, which leaves exactly minLeaves, and the node
+becomes a leaf next to the children it keeps
+*/
+void mergeOctreeLeaves(Octree& tree, const std::int32_t idx,
+                       const std::uint_fast32_t minLeaves) {
+    OctreeNode& node = tree.pool[idx];
+    std::array<std::int32_t*, 8> children;
+    std::uint_fast32_t childCount = 0;
+    for (std::int32_t& child : node.children)
+        if (child >= 0 && isBareOctreeLeaf(tree, child))
+            children[childCount++] = &child;
+
+    const std::uint_fast32_t created = node.leaf ? 0 : 1;
+    std::uint_fast32_t mergeCount = childCount;
+    if (tree.leafCount + created < minLeaves + childCount) {
+        mergeCount = tree.leafCount + created - minLeaves;
+        for (std::uint_fast32_t i = 1; i < childCount; i++) {
+            std::int32_t* const child = children[i];
+            std::uint_fast32_t j = i;
+            for (; j > 0 && tree.pool[*children[j - 1]].count >
+                                tree.pool[*child].count;
+                 j--)
+                children[j] = children[j - 1];
+            children[j] = child;
+        }
+    }
+
+    for (std::uint_fast32_t i = 0; i < mergeCount; i++) {
+        std::int32_t& child = *children[i];
+        const OctreeNode& leaf = tree.pool[child];
+        node.redAccum += leaf.redAccum;
+        node.greenAccum += leaf.greenAccum;
+        node.blueAccum += leaf.blueAccum;
+        node.count += leaf.count;
+        freeOctreeNode(tree, child);
+        child = -1;
+    }
+    node.leaf = true;
+    tree.leafCount = tree.leafCount + created - mergeCount;
+}
+
+/*
+Merges the children of the least populated node on the deepest reducible
+level into it, so that rare colors are folded before common ones. The
+children of a node on the deepest non-empty list are always bare leaves
+*/
+void reduceOctree(Octree& tree) {
+    int level = OCTREE_DEPTH - 1;
+    while (level > 0 && tree.reducible[level] < 0)
+        level--;
+
+    std::int32_t* link = &tree.reducible[level];
+    std::uint_fast64_t fewest = UINT64_MAX;
+    for (std::int32_t* it = link; *it >= 0; it = &tree.pool[*it].next) {
+        std::uint_fast64_t count = 0;
+        for (const std::int32_t child : tree.pool[*it].children)
+            if (child >= 0)
+                count += tree.pool[child].count;
+        if (count < fewest) {
+            fewest = count;
+            link = it;
+        }
+    }
+
+    const std::int32_t idx = *link;
+    *link = tree.pool[idx].next;
+    tree.pool[idx].next = -1;
+    mergeOctreeLeaves(tree, idx, 0);
+}
+
+/*
+Merges leaves until only numColors are left. Each time, the node whose bare
+leaf children would add the least squared error by being merged into it, on
+any level, has them merged. Unlike reducing the deepest level first, this
+lets colors rare enough to sit alone in an octant near the root be merged
+while common colors deeper down keep their detail
+*/
+void pruneOctree(Octree& tree, const std::int32_t root,
+                 const std::uint_fast32_t numColors) {
+    std::vector<std::int32_t> stack;
+    while (tree.leafCount > numColors) {
+        std::int32_t target = -1;
+        double cheapest = DBL_MAX;
+        stack.assign(1, root);
+        while (!stack.empty()) {
+            const std::int32_t idx = stack.back();
+            stack.pop_back();
+
+            // the error of merging is the squared norm of every sum over
+            // its count, less that of the merged sum over the merged count
+            const OctreeNode& node = tree.pool[idx];
+            bool hasLeaves = false;
+            double red = 0.0, green = 0.0, blue = 0.0, count = 0.0;
+            double error = 0.0;
+            auto add = [&](const OctreeNode& leaf) {
+                if (leaf.count == 0)
+                    return;
+                const double r = static_cast<double>(leaf.redAccum);
+                const double g = static_cast<double>(leaf.greenAccum);
+                const double b = static_cast<double>(leaf.blueAccum);
+                red += r;
+                green += g;
+                blue += b;
+                count += static_cast<double>(leaf.count);
+                error += (r * r + g * g + b * b) / leaf.count;
+            };
+            if (node.leaf)
+                add(node);
+            for (const std::int32_t child : node.children) {
+                if (child < 0)
+                    continue;
+                if (isBareOctreeLeaf(tree, child)) {
+                    hasLeaves = true;
+                    add(tree.pool[child]);
+                } else {
+                    stack.push_back(child);
+                }
+            }
+            if (count > 0.0)
+                error -= (red * red + green * green + blue * blue) / count;
+            if (hasLeaves && error < cheapest) {
+                cheapest = error;
+                target = idx;
+            }
+        }
+        mergeOctreeLeaves(tree, target, numColors);
+    }
+}
+
+/*
+Generates a palette by streaming every pixel, or every weighted color, into
+an octree, then reducing it until at most numColors leaves are left
+*/
+template <typename Data>
+std::vector<WeightedColor>
+octreeGeneratePalette(const Data& source,
+                      const std::uint_fast32_t numColors) {
+    if (source.empty() || numColors == 0)
+        return {};
+
+    const std::uint_fast32_t maxLeaves =
+        std::max(numColors, OCTREE_MAX_LEAVES);
+    Octree tree(maxLeaves);
+    const std::int32_t root = allocateOctreeNode(tree, false);
+    tree.reducible[0] = root;
+
+    for (const auto& item : source) {
+        insertOctree(tree, root, colorOf(item), weightOf(item));
+        while (tree.leafCount > maxLeaves)
+            reduceOctree(tree);
+    }
+    pruneOctree(tree, root, numColors);
+
+    std::vector<WeightedColor> palette;
+    for (const OctreeNode& node : tree.pool) {
+        if (!node.leaf || node.count == 0)
+            continue;
+        palette.push_back(WeightedColor(
+            RGBPixel(static_cast<std::uint8_t>(node.redAccum / node.count),
+                     static_cast<std::uint8_t>(node.greenAccum / node.count),
+                     static_cast<std::uint8_t>(node.blueAccum / node.count)),
+            static_cast<std::uint_fast32_t>(node.count)));
+    }
+    return palette;
+}
+
+/*
+Perceptual color space
+
+In the OKLab mode, colors are converted to OKLab before quantizing, and the
+palette is converted back to sRGB afterwards. The converted colors are
+stored in the same byte triples as sRGB ones, L in place of red, a in place
+of green and b in place of blue, all three scaled by the same factor, so
+that distances stay perceptually even along every channel, and every engine
+runs on them unchanged.
+
+Gamma decoding goes through a 256 entry table, and the cube roots of the
+conversion are approximated with a bit trick refined by a Newton step, so
+that 4 pixels at a time can be converted with SSE
+*/
+
+// OKLab units per byte step, and the offset that centers a and b in a byte
+const float OKLAB_SCALE = 255.0f;
+const float OKLAB_OFFSET = 0.5f;
+
+/*
+Scales an OKLab color into a byte triple
+*/
+RGBPixel quantizeOklab(const float l, const float a, const float b) {
+    auto toByte = [](const float x) {
+        return static_cast<std::uint8_t>(
+            std::lround(std::min(std::max(x, 0.0f), 255.0f)));
+    };
+    return RGBPixel(toByte(l * OKLAB_SCALE),
+                    toByte((a + OKLAB_OFFSET) * OKLAB_SCALE),
+                    toByte((b + OKLAB_OFFSET) * OKLAB_SCALE));
+}
+
+/*
+Converts a single sRGB color to unscaled OKLab, L, a and b in turn
+*/
+std::array<float, 3> toOklab(const RGBPixel& p) {
+    const float* table = SRGB_TO_LINEAR.data();
+    const float r = table[p.r], g = table[p.g], b = table[p.b];
+
+    const float l = std::cbrt(0.4122214708f * r + 0.5363325363f * g +
+                              0.0514459929f * b);
+    const float m = std::cbrt(0.2119034982f * r + 0.6806995451f * g +
+                              0.1073969566f * b);
+    const float s = std::cbrt(0.0883024619f * r + 0.2817188376f * g +
+                              0.6299787005f * b);
+
+    return {0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+            1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+            0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s};
+}
+
+/*
+Converts a single sRGB color to OKLab
+*/
+RGBPixel encodeOklab(const RGBPixel& p) {
+    const std::array<float, 3> lab = toOklab(p);
+    return quantizeOklab(lab[0], lab[1], lab[2]);
+}
+
+/*
+Converts an unscaled OKLab color back to sRGB
+*/
+RGBPixel fromOklab(const std::array<float, 3>& lab) {
+    const float L = lab[0], A = lab[1], B = lab[2];
+
+    float l = L + 0.3963377774f * A + 0.2158037573f * B;
+    float m = L - 0.1055613458f * A - 0.0638541728f * B;
+    float s = L - 0.0894841775f * A - 1.2914855480f * B;
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+
+    return RGBPixel(
+        linearToSrgb(4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s),
+        linearToSrgb(-1.2684380046f * l + 2.6097574011f * m -
+                     0.3413193965f * s),
+        linearToSrgb(-0.0041960863f * l - 0.7034186147f * m +
+                     1.7076147010f * s));
+}
+
+/*
+Converts a color stored as OKLab back to sRGB
+*/
+RGBPixel decodeOklab(const RGBPixel& p) {
+    return fromOklab({p.r / OKLAB_SCALE, p.g / OKLAB_SCALE - OKLAB_OFFSET,
+                      p.b / OKLAB_SCALE - OKLAB_OFFSET});
+}
+
+#ifdef __SSE2__
+/*
+Approximates the cube root of 4 non-negative values, starting from a guess
+made by dividing the exponent by 3, and refining it with a Newton step,
+which is within a byte of the exact conversion once scaled
+*/
+inline __m128 cbrtApprox(__m128 x) {
+    const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    x = _mm_max_ps(x, _mm_set1_ps(1e-12f));
+
+    __m128i bits = _mm_castps_si128(x);
+    __m128i guess = _mm_add_epi32(
+        _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(bits), third)),
+        _mm_set1_epi32(0x2a514067));
+    __m128 y = _mm_castsi128_ps(guess);
+    return _mm_mul_ps(third,
+                      _mm_add_ps(_mm_mul_ps(two, y),
+                                 _mm_div_ps(x, _mm_mul_ps(y, y))));
+}
+
+/*
+Converts 4 pixels to OKLab
+*/
+void encodeOklabBlock(const RGBPixel* source, RGBPixel* dest) {
+    const float* table = SRGB_TO_LINEAR.data();
+    const __m128 r = _mm_setr_ps(table[source[0].r], table[source[1].r],
+                                 table[source[2].r], table[source[3].r]);
+    const __m128 g = _mm_setr_ps(table[source[0].g], table[source[1].g],
+                                 table[source[2].g], table[source[3].g]);
+    const __m128 b = _mm_setr_ps(table[source[0].b], table[source[1].b],
+                                 table[source[2].b], table[source[3].b]);
+
+    auto dot = [](const __m128 x, const __m128 y, const __m128 z,
+                  const float cx, const float cy, const float cz) {
+        return _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(cx)),
+                       _mm_mul_ps(y, _mm_set1_ps(cy))),
+            _mm_mul_ps(z, _mm_set1_ps(cz)));
+    };
+
+    const __m128 l =
+        cbrtApprox(dot(r, g, b, 0.4122214708f, 0.5363325363f, 0.0514459929f));
+    const __m128 m =
+        cbrtApprox(dot(r, g, b, 0.2119034982f, 0.6806995451f, 0.1073969566f));
+    const __m128 s =
+        cbrtApprox(dot(r, g, b, 0.0883024619f, 0.2817188376f, 0.6299787005f));
+
+    const __m128 scale = _mm_set1_ps(OKLAB_SCALE);
+    const __m128 offset = _mm_set1_ps(OKLAB_OFFSET);
+    const __m128 lo = _mm_setzero_ps();
+    const __m128 hi = _mm_set1_ps(255.0f);
+    auto toBytes = [&](const __m128 x) {
+        return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+    };
+
+    alignas(16) std::int32_t ls[4], as[4], bs[4];
+    _mm_store_si128(
+        reinterpret_cast<__m128i*>(ls),
+        toBytes(_mm_mul_ps(dot(l, m, s, 0.2104542553f, 0.7936177850f,
+                               -0.0040720468f),
+                           scale)));
+    _mm_store_si128(
+        reinterpret_cast<__m128i*>(as),
+        toBytes(_mm_mul_ps(_mm_add_ps(dot(l, m, s, 1.9779984951f,
+                                          -2.4285922050f, 0.4505937099f),
+                                      offset),
+                           scale)));
+    _mm_store_si128(
+        reinterpret_cast<__m128i*>(bs),
+        toBytes(_mm_mul_ps(_mm_add_ps(dot(l, m, s, 0.0259040371f,
+                                          0.7827717662f, -0.8086757660f),
+                                      offset),
+                           scale)));
+
+    for (int i = 0; i < 4; i++)
+        dest[i] = RGBPixel(static_cast<std::uint8_t>(ls[i]),
+                             static_cast<std::uint8_t>(as[i]),
+                             static_cast<std::uint8_t>(bs[i]));
+}
+#endif
+
+/*
+Converts the colors from first to last to OKLab into dest, 4 at a time
+where SSE is available
+*/
+void encodeOklabRange(const RGBPixel* source, RGBPixel* dest,
+                      const std::size_t first, const std::size_t last) {
+    std::size_t i = first;
+#ifdef __SSE2__
+    for (; i + 4 <= last; i += 4)
+        encodeOklabBlock(&source[i], &dest[i]);
+#endif
+    for (; i < last; i++)
+        dest[i] = encodeOklab(source[i]);
+}
+
+/*
+Converts every pixel of source to OKLab into dest, in chunks spread across
+the pool. The source pixels are left alone, so the image can still be
+remapped in sRGB afterwards
+*/
+void encodeOklab(const PixelView& source,
+                 std::vector<RGBPixel>& dest, WorkerPool& pool) {
+    dest.resize(source.size());
+    const std::size_t parts = source.size() >= COOPERATIVE_MIN_PIXELS
+                                  ? pool.size()
+                                  : 1;
+    pool.run(parts, [&](const std::size_t part) {
+        std::size_t first, last;
+        chunkRange(0, source.size(), parts, part, first, last);
+        encodeOklabRange(source.data(), dest.data(), first, last);
+    });
+}
+
+/*
+Converts weighted colors to OKLab in place, 4 at a time where SSE is
+available
+*/
+void encodeOklab(std::vector<WeightedColor>& colors) {
+    std::vector<RGBPixel> source(colors.size());
+    for (std::size_t i = 0; i < colors.size(); i++)
+        source[i] = colors[i].color;
+    std::vector<RGBPixel> dest(colors.size());
+    encodeOklabRange(source.data(), dest.data(), 0, colors.size());
+    for (std::size_t i = 0; i < colors.size(); i++)
+        colors[i].color = dest[i];
+}
+
+/*
+Large images are not converted pixel by pixel, but counted into cells.
+Each channel is cut into a few levels, spaced more tightly near black where
+OKLab changes fastest, and every combination of levels makes a cell. Only
+the mean color of each occupied cell is converted, which lands within a few
+units of the exact conversion of any pixel in it, and the engines run on
+the cells weighted by their pixels, as the histogram engine does on its own
+*/
+
+// levels each channel is cut into, and how tightly they are packed near
+// black, as the exponent the channel is raised to before cutting it evenly
+const std::uint32_t OKLAB_CELL_LEVELS = 64;
+const double OKLAB_CELL_GAMMA = 0.6;
+
+// images with fewer pixels than there are cells are converted pixel by
+// pixel, which is exact and no slower for them
+const std::size_t OKLAB_CELLS =
+    OKLAB_CELL_LEVELS * OKLAB_CELL_LEVELS * OKLAB_CELL_LEVELS;
+
+/*
+Counts the pixels of source into the cells, in chunks spread across the
+pool, and returns the OKLab color of every occupied cell with its count
+*/
+std::vector<WeightedColor> countOklabCells(const PixelView& source,
+                                           WorkerPool& pool) {
+    // the level of every channel value, and the mean value of each level
+    std::array<std::uint32_t, 256> levels;
+    std::array<std::uint32_t, OKLAB_CELL_LEVELS> sums = {};
+    std::array<std::uint32_t, OKLAB_CELL_LEVELS> counts = {};
+    for (std::uint32_t v = 0; v < 256; v++) {
+        levels[v] = std::min(
+            OKLAB_CELL_LEVELS - 1,
+            static_cast<std::uint32_t>(OKLAB_CELL_LEVELS *
+                                       std::pow(v / 256.0, OKLAB_CELL_GAMMA)));
+        sums[levels[v]] += v;
+        counts[levels[v]]++;
+    }
+    std::array<std::uint8_t, OKLAB_CELL_LEVELS> means = {};
+    for (std::uint32_t level = 0; level < OKLAB_CELL_LEVELS; level++)
+        if (counts[level] > 0)
+            means[level] = static_cast<std::uint8_t>(
+                (sums[level] + counts[level] / 2) / counts[level]);
+
+    const std::size_t parts = source.size() >= COOPERATIVE_MIN_PIXELS
+                                  ? pool.size()
+                                  : 1;
+    std::vector<std::vector<std::uint32_t>> partCounts(
+        parts, std::vector<std::uint32_t>(OKLAB_CELLS, 0));
+    pool.run(parts, [&](const std::size_t part) {
+        std::size_t first, last;
+        chunkRange(0, source.size(), parts, part, first, last);
+        std::uint32_t* cells = partCounts[part].data();
+        for (std::size_t i = first; i < last; i++) {
+            const RGBPixel& p = source[i];
+            cells[(levels[p.r] * OKLAB_CELL_LEVELS + levels[p.g]) *
+                      OKLAB_CELL_LEVELS +
+                  levels[p.b]]++;
+        }
+    });
+
+    // only the occupied cells are converted
+    std::vector<WeightedColor> cells;
+    for (std::size_t cell = 0; cell < OKLAB_CELLS; cell++) {
+        std::uint_fast32_t count = 0;
+        for (const std::vector<std::uint32_t>& part : partCounts)
+            count += part[cell];
+        if (count == 0)
+            continue;
+        cells.push_back(WeightedColor(
+            RGBPixel(means[cell / (OKLAB_CELL_LEVELS * OKLAB_CELL_LEVELS)],
+                     means[cell / OKLAB_CELL_LEVELS % OKLAB_CELL_LEVELS],
+                     means[cell % OKLAB_CELL_LEVELS]),
+            count));
+    }
+
+    encodeOklab(cells);
+    return cells;
+}
+
+/*
+JPEG color space
+
+JPEGs store their colors as YCbCr, a luma and two chroma channels, with the
+chroma often kept at half the resolution of the luma or less. In the YCbCr
+mode, colors are quantized in that space, the luma in place of red, Cb in
+place of green and Cr in place of blue, and only the palette is converted
+back to sRGB. JPEGs are then decoded without upsampling their chroma or
+converting a single pixel, and other images are converted with the same
+full range JFIF formulas JPEG uses
+*/
+
+/*
+Converts a single sRGB color to YCbCr, with weights in 16 bit fixed point
+*/
+RGBPixel encodeYCbCr(const RGBPixel& p) {
+    auto toByte = [](const std::int_fast32_t x) {
+        return static_cast<std::uint8_t>(
+            std::min<std::int_fast32_t>((x + (1 << 15)) >> 16, 255));
+    };
+    const std::int_fast32_t r = p.r, g = p.g, b = p.b;
+    const std::int_fast32_t offset = 128 << 16;
+    return RGBPixel(toByte(19595 * r + 38470 * g + 7471 * b),
+                    toByte(offset - 11058 * r - 21710 * g + 32768 * b),
+                    toByte(offset + 32768 * r - 27439 * g - 5329 * b));
+}
+
+/*
+Converts a color stored as YCbCr back to sRGB, the way stb_image converts
+the pixels of a JPEG. The conversion writes an alpha byte after the color,
+so it goes through a 4 byte buffer
+*/
+RGBPixel decodeYCbCr(const RGBPixel& p) {
+    stbi_uc rgb[4];
+    stbi__YCbCr_to_RGB_row(rgb, &p.r, &p.g, &p.b, 1, 4);
+    return RGBPixel(rgb[0], rgb[1], rgb[2]);
+}
+
+/*
+Converts every pixel of source to YCbCr into dest, in chunks spread across
+the pool, leaving the source pixels alone
+*/
+void encodeYCbCr(const PixelView& source,
+                 std::vector<RGBPixel>& dest, WorkerPool& pool) {
+    dest.resize(source.size());
+    const std::size_t parts = source.size() >= COOPERATIVE_MIN_PIXELS
+                                  ? pool.size()
+                                  : 1;
+    pool.run(parts, [&](const std::size_t part) {
+        std::size_t first, last;
+        chunkRange(0, source.size(), parts, part, first, last);
+        for (std::size_t i = first; i < last; i++)
+            dest[i] = encodeYCbCr(source[i]);
+    });
+}
+
+/*
+Converts a single sRGB color to the given color space
+*/
+RGBPixel encodeColor(const RGBPixel& p, const ColorSpace space) {
+    if (space == ColorSpace::Oklab)
+        return encodeOklab(p);
+    if (space == ColorSpace::YCbCr)
+        return encodeYCbCr(p);
+    return p;
+}
+
+/*
+Converts a color stored in the given color space back to sRGB
+*/
+RGBPixel decodeColor(const RGBPixel& p, const ColorSpace space) {
+    if (space == ColorSpace::Oklab)
+        return decodeOklab(p);
+    if (space == ColorSpace::YCbCr)
+        return decodeYCbCr(p);
+    return p;
+}
+
+/*
+Refining a palette with k-means
+
+The palette from a quantizer is used as the seeds for a few iterations of
+Lloyd's algorithm, each of which assigns every color to its nearest
+centroid, and moves each centroid to the mean of the colors assigned to it
+*/
+
+// stop once no centroid moves further than this, in 8-bit channel units
+const float KMEANS_TOLERANCE = 0.5f;
+
+/*
+Returns the index of the centroid nearest to the given color. The centroids
+are stored planar, and padded to a multiple of 4 with centroids that are
+never the nearest, so that 4 distances can be computed at once
+*/
+std::uint_fast32_t nearestCentroid(const RGBPixel& p, const float* red,
+                                   const float* green, const float* blue,
+                                   const std::size_t paddedCount) {
+#ifdef __SSE2__
+    const __m128 pr = _mm_set1_ps(p.r);
+    const __m128 pg = _mm_set1_ps(p.g);
+    const __m128 pb = _mm_set1_ps(p.b);
+    const __m128i four = _mm_set1_epi32(4);
+
+    __m128 best = _mm_set1_ps(FLT_MAX);
+    __m128i bestIdx = _mm_setzero_si128();
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    for (std::size_t i = 0; i < paddedCount; i += 4) {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(red + i), pr);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(green + i), pg);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(blue + i), pb);
+        __m128 dist = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)),
+            _mm_mul_ps(db, db));
+
+        __m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, best));
+        best = _mm_min_ps(dist, best);
+        bestIdx = _mm_or_si128(_mm_and_si128(closer, idx),
+                               _mm_andnot_si128(closer, bestIdx));
+        idx = _mm_add_epi32(idx, four);
+    }
+
+    alignas(16) float dists[4];
+    alignas(16) std::int32_t indices[4];
+    _mm_store_ps(dists, best);
+    _mm_store_si128(reinterpret_cast<__m128i*>(indices), bestIdx);
+
+    std::uint_fast32_t nearest = indices[0];
+    float nearestDist = dists[0];
+    for (int lane = 1; lane < 4; lane++) {
+        if (dists[lane] < nearestDist ||
+            (dists[lane] == nearestDist &&
+             static_cast<std::uint_fast32_t>(indices[lane]) < nearest)) {
+            nearest = indices[lane];
+            nearestDist = dists[lane];
+        }
+    }
+    return nearest;
+#else
+    std::uint_fast32_t nearest = 0;
+    float nearestDist = FLT_MAX;
+    for (std::size_t i = 0; i < paddedCount; i++) {
+        float dr = red[i] - p.r;
+        float dg = green[i] - p.g;
+        float db = blue[i] - p.b;
+        float dist = dr * dr + dg * dg + db * db;
+        if (dist < nearestDist) {
+            nearest = static_cast<std::uint_fast32_t>(i);
+            nearestDist = dist;
+        }
+    }
+    return nearest;
+#endif
+}
+
+/*
+Runs up to maxIterations of Lloyd's algorithm over data, starting from the
+given palette. Every iteration splits the colors between the threads of the
+pool, each summing its share into its own accumulators, which are then
+reduced into the new centroids. Each color of the refined palette counts
+the pixels that were last assigned to it
+*/
+template <typename Data>
+std::vector<WeightedColor>
+kMeansRefinePalette(const Data& data,
+                    const std::vector<WeightedColor>& seeds,
+                    const std::uint_fast32_t maxIterations, WorkerPool& pool) {
+    if (data.empty() || seeds.empty())
+        return seeds;
+
+    struct Accumulator {
+        std::uint_fast64_t redAccum = 0;
+        std::uint_fast64_t greenAccum = 0;
+        std::uint_fast64_t blueAccum = 0;
+        std::uint_fast64_t count = 0;
+    };
+
+    // the padding centroids sit far outside of the color cube
+    const std::size_t numCentroids = seeds.size();
+    const std::size_t paddedCount = (numCentroids + 3) / 4 * 4;
+    std::vector<float> red(paddedCount, 1e9f);
+    std::vector<float> green(paddedCount, 1e9f);
+    std::vector<float> blue(paddedCount, 1e9f);
+    for (std::size_t i = 0; i < numCentroids; i++) {
+        red[i] = seeds[i].color.r;
+        green[i] = seeds[i].color.g;
+        blue[i] = seeds[i].color.b;
+    }
+
+    const std::size_t workers = std::max<std::size_t>(
+        1, std::min<std::size_t>(pool.size(), data.size() / 4096));
+    std::vector<std::vector<Accumulator>> partials(
+        workers, std::vector<Accumulator>(numCentroids));
+    std::vector<std::uint_fast64_t> counts(numCentroids, 0);
+
+    for (std::uint_fast32_t iteration = 0; iteration < maxIterations;
+         iteration++) {
+        pool.run(workers, [&](const std::size_t worker) {
+            std::vector<Accumulator>& accum = partials[worker];
+            std::fill(accum.begin(), accum.end(), Accumulator());
+            std::size_t first, last;
+            chunkRange(0, data.size(), workers, worker, first, last);
+            for (std::size_t i = first; i < last; i++) {
+                const RGBPixel& p = colorOf(data[i]);
+                const std::uint_fast64_t weight = weightOf(data[i]);
+                Accumulator& a = accum[nearestCentroid(
+                    p, red.data(), green.data(), blue.data(), paddedCount)];
+                a.redAccum += p.r * weight;
+                a.greenAccum += p.g * weight;
+                a.blueAccum += p.b * weight;
+                a.count += weight;
+            }
+        });
+
+        // a centroid nothing was assigned to stays where it was, and is
+        // dropped from the palette if that is still the case at the end
+        float maxShift = 0.0f;
+        for (std::size_t i = 0; i < numCentroids; i++) {
+            Accumulator total;
+            for (const std::vector<Accumulator>& accum : partials) {
+                total.redAccum += accum[i].redAccum;
+                total.greenAccum += accum[i].greenAccum;
+                total.blueAccum += accum[i].blueAccum;
+                total.count += accum[i].count;
+            }
+            counts[i] = total.count;
+            if (total.count == 0)
+                continue;
+
+            float r = static_cast<float>(total.redAccum) / total.count;
+            float g = static_cast<float>(total.greenAccum) / total.count;
+            float b = static_cast<float>(total.blueAccum) / total.count;
+            maxShift = std::max({maxShift, std::abs(r - red[i]),
+                                 std::abs(g - green[i]),
+                                 std::abs(b - blue[i])});
+            red[i] = r;
+            green[i] = g;
+            blue[i] = b;
+        }
+
+        if (maxShift <= KMEANS_TOLERANCE)
+            break;
+    }
+
+    std::vector<WeightedColor> palette;
+    for (std::size_t i = 0; i < numCentroids; i++) {
+        if (counts[i] == 0)
+            continue;
+        palette.push_back(WeightedColor(
+            RGBPixel(static_cast<std::uint8_t>(std::lround(red[i])),
+                     static_cast<std::uint8_t>(std::lround(green[i])),
+                     static_cast<std::uint8_t>(std::lround(blue[i]))),
+            static_cast<std::uint_fast32_t>(counts[i])));
+    }
+    return palette;
+}
+
+/*
+Grayscale quantizer
+
+Gray images only have 256 possible levels, so rather than quantizing three
+identical channels, the levels are counted into a histogram, and split into
+the contiguous ranges of levels that leave the least squared error, which
+is the optimal palette. The error of any range comes from prefix sums of
+the counts, sums and sums of squares of the levels, so the ranges are
+found with dynamic programming over the occupied levels, in
+O(colors * levels^2) time, whatever the size of the image
+*/
+
+typedef std::array<std::uint_fast64_t, 256> GrayHistogram;
+
+/*
+The least squared errors of splitting the occupied levels of a histogram
+into every number of ranges up to some size, and where the last range
+starts in each of those splits
+*/
+struct GrayPartition {
+    std::vector<std::uint8_t> levels;
+    std::vector<double> counts;
+    std::vector<double> sums;
+    std::vector<double> squares;
+    // errors[c][j] is the least error of the first j levels in c + 1 ranges
+    std::vector<std::vector<double>> errors;
+    std::vector<std::vector<std::uint16_t>> starts;
+
+    double error(const std::size_t first, const std::size_t last) const {
+        const double count = counts[last] - counts[first];
+        const double sum = sums[last] - sums[first];
+        return squares[last] - squares[first] - sum * sum / count;
+    }
+};
+
+/*
+Splits the occupied levels of a histogram optimally into every number of
+ranges up to numColors
+*/
+GrayPartition partitionGrayLevels(const GrayHistogram& histogram,
+                                  const std::uint_fast32_t numColors) {
+    GrayPartition partition;
+    partition.counts.push_back(0.0);
+    partition.sums.push_back(0.0);
+    partition.squares.push_back(0.0);
+    for (std::size_t value = 0; value < 256; value++) {
+        if (histogram[value] == 0)
+            continue;
+        const double count = static_cast<double>(histogram[value]);
+        partition.levels.push_back(static_cast<std::uint8_t>(value));
+        partition.counts.push_back(partition.counts.back() + count);
+        partition.sums.push_back(partition.sums.back() + count * value);
+        partition.squares.push_back(partition.squares.back() +
+                                    count * value * value);
+    }
+
+    const std::size_t levels = partition.levels.size();
+    const std::size_t rows = std::min<std::size_t>(numColors, levels);
+    partition.errors.assign(rows, std::vector<double>(levels + 1, 0.0));
+    partition.starts.assign(rows, std::vector<std::uint16_t>(levels + 1, 0));
+    for (std::size_t j = 1; j <= levels; j++)
+        partition.errors[0][j] = partition.error(0, j);
+    for (std::size_t c = 1; c < rows; c++) {
+        for (std::size_t j = c + 1; j <= levels; j++) {
+            double best = DBL_MAX;
+            for (std::size_t i = c; i < j; i++) {
+                const double error =
+                    partition.errors[c - 1][i] + partition.error(i, j);
+                if (error < best) {
+                    best = error;
+                    partition.starts[c][j] = static_cast<std::uint16_t>(i);
+                }
+            }
+            partition.errors[c][j] = best;
+        }
+    }
+    return partition;
+}
+
+/*
+Returns how many colors a gray image is worth, which is up to and including
+the last color that still lowers the squared error by at least minGain per
+pixel, as palette trees do
+*/
+std::uint_fast32_t grayColors(const GrayPartition& partition,
+                              const float minGain) {
+    const std::size_t levels = partition.levels.size();
+    std::size_t colors = partition.errors.size();
+    while (colors > 1 &&
+           (partition.errors[colors - 2][levels] -
+            partition.errors[colors - 1][levels]) /
+                   partition.counts[levels] <
+               minGain)
+        colors--;
+    return static_cast<std::uint_fast32_t>(colors);
+}
+
+/*
+Returns the optimal palette of numColors grays, darkest first, with each
+color the mean of its range, weighted by its pixels
+*/
+std::vector<WeightedColor> grayPalette(const GrayPartition& partition,
+                                       const std::uint_fast32_t numColors) {
+    std::vector<WeightedColor> palette;
+    std::size_t last = partition.levels.size();
+    std::size_t c = std::min<std::size_t>(numColors, partition.errors.size());
+    while (c > 0) {
+        c--;
+        const std::size_t first = c > 0 ? partition.starts[c][last] : 0;
+        const double count = partition.counts[last] - partition.counts[first];
+        const std::uint8_t gray = static_cast<std::uint8_t>(
+            (partition.sums[last] - partition.sums[first]) / count);
+        palette.push_back(WeightedColor(
+            RGBPixel(gray, gray, gray),
+            static_cast<std::uint_fast32_t>(count)));
+        last = first;
+    }
+    std::reverse(palette.begin(), palette.end());
+    return palette;
+}
+
+/*
+Remapping an image onto its palette
+
+Every pixel is replaced by its nearest palette color. Rather than scanning
+the whole palette for every pixel, the color cube is cut into a 32x32x32
+grid, and each cell keeps the few palette colors that can be nearest to any
+point inside of it, most cells keeping a single one. Looking a pixel up
+then only compares it against the colors of its own cell
+*/
+
+// bits per channel of the inverse colormap grid
+const std::uint_fast32_t INVERSE_COLORMAP_BITS = 5;
+
+// marks a cell of the inverse colormap with more than one candidate
+const std::uint16_t SHARED_CELL = 0xffff;
+
+struct InverseColormap {
+    std::vector<RGBPixel> colors;
+    // the only candidate of each cell, or SHARED_CELL if there are more
+    std::vector<std::uint16_t> cells;
+    // the candidates of cell i are candidates[offsets[i], offsets[i + 1])
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint16_t> candidates;
+
+    /*
+    Returns the index of the palette color nearest to p
+    */
+    std::uint16_t nearest(const RGBPixel& p) const {
+        const std::uint_fast32_t shift = 8 - INVERSE_COLORMAP_BITS;
+        const std::size_t cell =
+            ((std::size_t(p.r >> shift) << INVERSE_COLORMAP_BITS |
+              (p.g >> shift))
+             << INVERSE_COLORMAP_BITS) |
+            (p.b >> shift);
+        if (cells[cell] != SHARED_CELL)
+            return cells[cell];
+
+        const std::uint32_t first = offsets[cell];
+        const std::uint32_t last = offsets[cell + 1];
+
+        std::uint16_t best = candidates[first];
+        std::int_fast32_t bestDistance = INT32_MAX;
+        for (std::uint32_t i = first; i < last && bestDistance > 0; i++) {
+            const RGBPixel& c = colors[candidates[i]];
+            const std::int_fast32_t dr = p.r - c.r;
+            const std::int_fast32_t dg = p.g - c.g;
+            const std::int_fast32_t db = p.b - c.b;
+            const std::int_fast32_t distance = dr * dr + dg * dg + db * db;
+            if (distance < bestDistance) {
+                bestDistance = distance;
+                best = candidates[i];
+            }
+        }
+        return best;
+    }
+};
+
+/*
+Builds the inverse colormap of a palette. A color can only be the nearest
+to some point of a cell if its distance to the closest point of the cell
+is no more than the smallest distance any color has to the farthest point
+of the cell, so only those colors are kept
+*/
+InverseColormap
+buildInverseColormap(const std::vector<WeightedColor>& palette) {
+    const std::int_fast32_t side = 1 << INVERSE_COLORMAP_BITS;
+    const std::int_fast32_t width = 256 / side;
+
+    InverseColormap map;
+    for (const WeightedColor& color : palette)
+        map.colors.push_back(color.color);
+    map.cells.reserve(side * side * side);
+    map.offsets.reserve(side * side * side + 1);
+
+    // squared distances along one channel from a value to the nearest and
+    // farthest points of a cell
+    auto bounds = [width](const std::int_fast32_t value,
+                          const std::int_fast32_t cell,
+                          std::int_fast32_t& nearest,
+                          std::int_fast32_t& farthest) {
+        const std::int_fast32_t lo = cell * width;
+        const std::int_fast32_t hi = lo + width - 1;
+        const std::int_fast32_t gap =
+            value < lo ? lo - value : value > hi ? value - hi : 0;
+        const std::int_fast32_t reach = std::max(value - lo, hi - value);
+        nearest = gap * gap;
+        farthest = reach * reach;
+    };
+
+    std::vector<std::int_fast32_t> nearest(map.colors.size());
+    for (std::int_fast32_t r = 0; r < side; r++) {
+        for (std::int_fast32_t g = 0; g < side; g++) {
+            for (std::int_fast32_t b = 0; b < side; b++) {
+                std::int_fast32_t limit = INT32_MAX;
+                for (std::size_t i = 0; i < map.colors.size(); i++) {
+                    const RGBPixel& c = map.colors[i];
+                    std::int_fast32_t nr, ng, nb, fr, fg, fb;
+                    bounds(c.r, r, nr, fr);
+                    bounds(c.g, g, ng, fg);
+                    bounds(c.b, b, nb, fb);
+                    nearest[i] = nr + ng + nb;
+                    limit = std::min(limit, fr + fg + fb);
+                }
+
+                const std::size_t first = map.candidates.size();
+                map.offsets.push_back(static_cast<std::uint32_t>(first));
+                for (std::size_t i = 0; i < map.colors.size(); i++)
+                    if (nearest[i] <= limit)
+                        map.candidates.push_back(
+                            static_cast<std::uint16_t>(i));
+                map.cells.push_back(map.candidates.size() - first == 1
+                                        ? map.candidates[first]
+                                        : SHARED_CELL);
+            }
+        }
+    }
+    map.offsets.push_back(static_cast<std::uint32_t>(map.candidates.size()));
+    return map;
+}
+
+/*
+Replaces every pixel with its nearest palette color in place, in chunks
+spread across the pool. Runs of equal pixels are common, so the previous
+lookup is reused while the color does not change
+*/
+void remapImage(PixelView& pixels, const InverseColormap& map,
+                WorkerPool& pool) {
+    const std::size_t parts = pixels.size() >= COOPERATIVE_MIN_PIXELS
+                                  ? pool.size()
+                                  : 1;
+    pool.run(parts, [&](const std::size_t part) {
+        std::size_t first, last;
+        chunkRange(0, pixels.size(), parts, part, first, last);
+        std::uint32_t lastKey = 0xffffffff;
+        RGBPixel lastColor;
+        for (std::size_t i = first; i < last; i++) {
+            const std::uint32_t key = packColor(pixels[i]);
+            if (key != lastKey) {
+                lastKey = key;
+                lastColor = map.colors[map.nearest(pixels[i])];
+            }
+            pixels[i] = lastColor;
+        }
+    });
+}
+
+/*
+Remaps the image with Floyd-Steinberg error diffusion, which spreads the
+difference between every pixel and its palette color over the neighbours
+still to come, 7/16 to the right and 3/16, 5/16 and 1/16 along the next row.
+Each pixel depends on the ones before it, so this runs on a single thread,
+with the errors of the current and the next row kept in 16ths. The pixels
+are replaced in place
 */
-struct RGBPixel {
-    std::uint8_t r;
-    std::uint8_t g;
-    std::uint8_t b;
+void ditherImage(PixelView& pixels, const std::size_t width,
+                 const std::size_t height, const InverseColormap& map) {
+    // one pixel of padding on either side keeps the edges branch free
+    std::vector<std::int32_t> current((width + 2) * 3, 0);
+    std::vector<std::int32_t> next((width + 2) * 3, 0);
 
-    RGBPixel() : r(0), g(0), b(0) {}
-    RGBPixel(uint8_t _r, uint8_t _g, uint8_t _b) : r(_r), g(_g), b(_b) {}
+    auto clamp = [](const std::int32_t x) {
+        return static_cast<std::uint8_t>(x < 0 ? 0 : x > 255 ? 255 : x);
+    };
+
+    for (std::size_t y = 0; y < height; y++) {
+        std::fill(next.begin(), next.end(), 0);
+        RGBPixel* row = &pixels[y * width];
+        const std::int32_t* above = &current[3];
+        std::int32_t* below = &next[3];
+
+        // the error carried to the right stays out of memory
+        std::int32_t right[3] = {0, 0, 0};
+        for (std::size_t x = 0; x < width; x++, above += 3, below += 3) {
+            const RGBPixel wanted(clamp(row[x].r + (above[0] + right[0]) / 16),
+                                  clamp(row[x].g + (above[1] + right[1]) / 16),
+                                  clamp(row[x].b + (above[2] + right[2]) / 16));
+            const RGBPixel& picked = map.colors[map.nearest(wanted)];
+            row[x] = picked;
+
+            const std::int32_t diff[3] = {wanted.r - picked.r,
+                                          wanted.g - picked.g,
+                                          wanted.b - picked.b};
+            for (std::ptrdiff_t c = 0; c < 3; c++) {
+                right[c] = diff[c] * 7;
+                below[c - 3] += diff[c] * 3;
+                below[c] += diff[c] * 5;
+                below[c + 3] += diff[c];
+            }
+        }
+        std::swap(current, next);
+    }
+}
+
+/*
+Writes pixels as a binary PPM image, and returns true if successful
+*/
+bool writePPM(const std::string& filename, const PixelView& pixels,
+              const std::size_t width, const std::size_t height) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write(reinterpret_cast<const char*>(pixels.data()),
+               static_cast<std::streamsize>(pixels.size() * sizeof(RGBPixel)));
+    return static_cast<bool>(file);
+}
+
+/*
+Input files
+
+Images are decoded from memory rather than through stdio. Regular files are
+mapped, which needs no copy, shares the page cache with any other process
+reading the same file, and lets the kernel read ahead, as it is told the
+whole file is about to be read in order. Pipes and other special files
+cannot be mapped, so they are read into a buffer of their own instead
+*/
+#if defined(__unix__) || defined(__APPLE__)
+// the whole file is decoded, so where supported, its pages are mapped in
+// one go, rather than faulted in one at a time
+#ifdef MAP_POPULATE
+const int MAP_FLAGS = MAP_PRIVATE | MAP_POPULATE;
+#else
+const int MAP_FLAGS = MAP_PRIVATE;
+#endif
+#endif
+
+class InputFile {
+  public:
+    explicit InputFile(const std::string& filename) {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+            info.st_size > 0 && info.st_size <= INT_MAX) {
+            const std::size_t size = static_cast<std::size_t>(info.st_size);
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_FLAGS, fd, 0);
+            if (mapped != MAP_FAILED) {
+                madvise(mapped, size, MADV_SEQUENTIAL);
+                madvise(mapped, size, MADV_WILLNEED);
+                mapping = mapped;
+                bytes = static_cast<const stbi_uc*>(mapped);
+                length = size;
+            }
+        }
+        if (mapping == nullptr)
+            readAll(fd);
+        close(fd);
+#else
+        std::ifstream file(filename, std::ios::binary);
+        buffer.assign(std::istreambuf_iterator<char>(file),
+                      std::istreambuf_iterator<char>());
+        if (!file.bad() && buffer.size() <= INT_MAX) {
+            bytes = buffer.data();
+            length = buffer.size();
+        }
+#endif
+    }
+
+    ~InputFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping != nullptr)
+            munmap(mapping, length);
+#endif
+    }
+
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+
+    bool loaded() const { return length > 0; }
+    const stbi_uc* data() const { return bytes; }
+    int size() const { return static_cast<int>(length); }
+
+  private:
+#if defined(__unix__) || defined(__APPLE__)
+    /*
+    Reads everything left in fd into the buffer, which stays empty if
+    reading fails, or if there is more than stb_image can decode
+    */
+    void readAll(const int fd) {
+        const std::size_t chunk = 1 << 16;
+        std::size_t used = 0;
+        while (true) {
+            buffer.resize(used + chunk);
+            const ssize_t got = read(fd, buffer.data() + used, chunk);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0 || used + got > INT_MAX) {
+                buffer.clear();
+                return;
+            }
+            if (got == 0)
+                break;
+            used += static_cast<std::size_t>(got);
+        }
+        buffer.resize(used);
+        bytes = buffer.data();
+        length = used;
+    }
+#endif
+
+    void* mapping = nullptr;
+    std::vector<stbi_uc> buffer;
+    const stbi_uc* bytes = nullptr;
+    std::size_t length = 0;
 };
 
 /*
-Comparators used for sorting
+Frees a buffer stb_image decoded an image into
 */
+struct StbiFree {
+    void operator()(RGBPixel* data) const { stbi_image_free(data); }
+};
+
+typedef std::unique_ptr<RGBPixel, StbiFree> ImageBuffer;
 
-bool cmpRed(const RGBPixel& x, const RGBPixel& y) { return x.r < y.r; }
+/*
+Draft JPEG decoding
 
-bool cmpGreen(const RGBPixel& x, const RGBPixel& y) { return x.g < y.g; }
+A palette does not need every pixel, and the DC coefficient of each 8x8
+block of a JPEG already gives the mean of the block. Baseline JPEGs can be
+decoded at 1/8 of their resolution by keeping only those, which skips the
+inverse DCT, the chroma upsampling, and the color conversion of 63 in
+every 64 pixels. The AC coefficients still have to be Huffman decoded to
+find where the next block starts, but are thrown away. stb_image does the
+rest, from parsing the markers and tables to converting the colors, and
+progressive JPEGs are left to it entirely
+*/
 
-bool cmpBlue(const RGBPixel& x, const RGBPixel& y) { return x.b < y.b; }
+/*
+The block means of a component, one byte per 8x8 block
+*/
+struct BlockMeans {
+    std::vector<std::uint8_t> means;
+    std::size_t stride;
+};
 
 /*
-Determines primary color and sorts boxes by dominant color channel
+Decodes the next block of component n, keeping its mean, and skipping over
+its AC coefficients without storing them. Returns false if the data is
+corrupt
 */
-void sortBoxes(std::vector<RGBPixel>& box, std::uint8_t& redRange,
-               std::uint8_t& greenRange, std::uint8_t& blueRange) {
-    redRange = (*std::max_element(box.begin(), box.end(), cmpRed)).r -
-               (*std::min_element(box.begin(), box.end(), cmpRed)).r;
-    greenRange = (*std::max_element(box.begin(), box.end(), cmpGreen)).g -
-                 (*std::min_element(box.begin(), box.end(), cmpGreen)).g;
-    blueRange = (*std::max_element(box.begin(), box.end(), cmpBlue)).b -
-                (*std::min_element(box.begin(), box.end(), cmpBlue)).b;
+bool decodeBlockMean(stbi__jpeg* j, const int n, std::uint8_t& mean) {
+    if (j->code_bits < 16)
+        stbi__grow_buffer_unsafe(j);
+    const int t = stbi__jpeg_huff_decode(j, j->huff_dc + j->img_comp[n].hd);
+    if (t < 0)
+        return false;
+    const int dc =
+        j->img_comp[n].dc_pred + (t ? stbi__extend_receive(j, t) : 0);
+    j->img_comp[n].dc_pred = dc;
+
+    // the inverse DCT of a lone DC coefficient is DC / 8 + 128 everywhere
+    const int value = (dc * j->dequant[j->img_comp[n].tq][0] + 1028) >> 3;
+    mean = static_cast<std::uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
 
-    if (redRange >= greenRange && redRange >= blueRange) {
-        std::sort(std::begin(box), std::end(box), cmpRed);
-    } else if (greenRange >= redRange && greenRange >= blueRange) {
-        std::sort(std::begin(box), std::end(box), cmpGreen);
-    } else if (blueRange >= redRange && blueRange >= greenRange) {
-        std::sort(std::begin(box), std::end(box), cmpBlue);
+    const int ha = j->img_comp[n].ha;
+    for (int k = 1; k < 64;) {
+        if (j->code_bits < 16)
+            stbi__grow_buffer_unsafe(j);
+        const int c =
+            (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS) - 1);
+        const int r = j->fast_ac[ha][c];
+        int s;
+        if (r) {
+            // the fast table holds the run, and the code and value lengths
+            k += ((r >> 4) & 15) + 1;
+            s = r & 15;
+        } else {
+            const int rs = stbi__jpeg_huff_decode(j, j->huff_ac + ha);
+            if (rs < 0)
+                return false;
+            s = rs & 15;
+            if (s == 0) {
+                if (rs != 0xf0)
+                    break;
+                k += 16;
+                continue;
+            }
+            k += (rs >> 4) + 1;
+            if (j->code_bits < s)
+                stbi__grow_buffer_unsafe(j);
+        }
+        j->code_buffer <<= s;
+        j->code_bits -= s;
     }
+    return true;
 }
 
 /*
-Adapted from
-https://indiegamedev.net/2020/01/17/median-cut-with-floyd-steinberg-dithering-in-c/
+Counts down the restart interval after an MCU, and returns false once the
+scan is over, either at its end or at corrupt data, which leaves the blocks
+that were decoded so far, as stb_image does
 */
-std::vector<RGBPixel>
-medianCutGeneratePalette(const std::vector<RGBPixel>& source,
-                         const std::uint_fast32_t numColors) {
-    typedef std::vector<RGBPixel> Box;
-    typedef std::pair<std::uint8_t, Box> RangeBox;
+bool nextRestart(stbi__jpeg* j) {
+    if (--j->todo > 0)
+        return true;
+    if (j->code_bits < 24)
+        stbi__grow_buffer_unsafe(j);
+    if (!STBI__RESTART(j->marker))
+        return false;
+    stbi__jpeg_reset(j);
+    return true;
+}
 
-    std::vector<RangeBox> boxes;
-    Box init = source;
-    boxes.push_back(RangeBox(0, init));
+/*
+Decodes the block means of every component in a baseline scan, in the
+same order stb_image decodes whole blocks. Returns false if the data is
+corrupt
+*/
+bool decodeScanMeans(stbi__jpeg* j, std::vector<BlockMeans>& components,
+                     const int hMax, const int vMax, const int mcuX,
+                     const int mcuY) {
+    stbi__jpeg_reset(j);
+    if (j->scan_n == 1) {
+        // a lone component is stored a block at a time, in raster order,
+        // and only over the blocks the component actually covers
+        const int n = j->order[0];
+        const int w = ((j->s->img_x * j->img_comp[n].h + hMax - 1) / hMax +
+                       7) >> 3;
+        const int h = ((j->s->img_y * j->img_comp[n].v + vMax - 1) / vMax +
+                       7) >> 3;
+        BlockMeans& plane = components[n];
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                if (!decodeBlockMean(j, n, plane.means[y * plane.stride + x]))
+                    return false;
+                if (!nextRestart(j))
+                    return true;
+            }
+        }
+        return true;
+    }
 
-    while (boxes.size() < numColors) {
-        for (RangeBox& boxData : boxes) {
-            std::uint8_t redRange;
-            std::uint8_t greenRange;
-            std::uint8_t blueRange;
-            if (std::get<0>(boxData) == 0) {
-                sortBoxes(std::get<1>(boxData), redRange, greenRange,
-                          blueRange);
-
-                if (redRange >= greenRange && redRange >= blueRange) {
-                    std::get<0>(boxData) = redRange;
-                } else if (greenRange >= redRange && greenRange >= blueRange) {
-                    std::get<0>(boxData) = greenRange;
-                } else {
-                    std::get<0>(boxData) = blueRange;
+    for (int my = 0; my < mcuY; my++) {
+        for (int mx = 0; mx < mcuX; mx++) {
+            for (int k = 0; k < j->scan_n; k++) {
+                const int n = j->order[k];
+                BlockMeans& plane = components[n];
+                for (int y = 0; y < j->img_comp[n].v; y++) {
+                    for (int x = 0; x < j->img_comp[n].h; x++) {
+                        const std::size_t row = my * j->img_comp[n].v + y;
+                        const std::size_t column = mx * j->img_comp[n].h + x;
+                        if (!decodeBlockMean(
+                                j, n, plane.means[row * plane.stride + column]))
+                            return false;
+                    }
                 }
             }
+            if (!nextRestart(j))
+                return true;
         }
+    }
+    return true;
+}
 
-        std::sort(boxes.begin(), boxes.end(),
-                  [](const RangeBox& a, const RangeBox& b) {
-                      return std::get<0>(a) < std::get<0>(b);
-                  });
+/*
+Returns whether a JPEG with 3 components stores them as RGB rather than
+YCbCr, which stb_image tells by its markers
+*/
+bool isRGBJpeg(const stbi__jpeg* j) {
+    return j->s->img_n == 3 &&
+           (j->rgb == 3 || (j->app14_color_transform == 0 && !j->jfif));
+}
 
-        std::vector<RangeBox>::iterator itr = std::prev(boxes.end());
-        Box biggestBox = std::get<1>(*itr);
-        boxes.erase(itr);
-
-        Box splitA(biggestBox.begin(),
-                   biggestBox.begin() + biggestBox.size() / 2);
-        Box splitB(biggestBox.begin() + biggestBox.size() / 2,
-                   biggestBox.end());
-
-        boxes.push_back(RangeBox(0, splitA));
-        boxes.push_back(RangeBox(0, splitB));
-    }
-
-    // each box in boxes can be averaged to determine the colour
-    std::vector<RGBPixel> palette;
-    for (const RangeBox& boxData : boxes) {
-        Box box = std::get<1>(boxData);
-        std::uint_fast32_t redAccum = 0;
-        std::uint_fast32_t greenAccum = 0;
-        std::uint_fast32_t blueAccum = 0;
-        std::for_each(box.begin(), box.end(), [&](const RGBPixel& p) {
-            redAccum += p.r;
-            greenAccum += p.g;
-            blueAccum += p.b;
-        });
-        redAccum /= static_cast<std::uint_fast32_t>(box.size());
-        greenAccum /= static_cast<std::uint_fast32_t>(box.size());
-        blueAccum /= static_cast<std::uint_fast32_t>(box.size());
+/*
+Reads the header of a JPEG from input, and returns its decoder if it can be
+decoded for a draft, being a baseline JPEG with one or three components, or
+nullptr otherwise. The decoder reads through context
+*/
+std::unique_ptr<stbi__jpeg> openDraftJpeg(const InputFile& input,
+                                          stbi__context& context) {
+    stbi__start_mem(&context, input.data(), input.size());
+    if (!stbi__jpeg_test(&context))
+        return nullptr;
+
+    std::unique_ptr<stbi__jpeg> j(new stbi__jpeg());
+    j->s = &context;
+    stbi__setup_jpeg(j.get());
+    j->restart_interval = 0;
+    if (!stbi__decode_jpeg_header(j.get(), STBI__SCAN_header) ||
+        j->progressive || (context.img_n != 1 && context.img_n != 3))
+        return nullptr;
+    return j;
+}
+
+/*
+Decodes a baseline JPEG at 1/8 of its resolution, a pixel per 8x8 block of
+the image, into buffer, and returns true if successful. The pixels are left
+in YCbCr if ycbcr is set. Returns false for anything else, including
+progressive and CMYK JPEGs, which are then decoded in full
+*/
+bool loadDraftJpeg(const InputFile& input, ImageBuffer& buffer, int& width,
+                   int& height, const bool ycbcr) {
+    stbi__context context;
+    const std::unique_ptr<stbi__jpeg> j = openDraftJpeg(input, context);
+    if (j == nullptr)
+        return false;
 
-        palette.push_back({static_cast<std::uint8_t>(
-                               std::min(static_cast<int>(redAccum), 255)),
-                           static_cast<std::uint8_t>(
-                               std::min(static_cast<int>(greenAccum), 255)),
-                           static_cast<std::uint8_t>(
-                               std::min(static_cast<int>(blueAccum), 255))});
+    const int count = context.img_n;
+    int hMax = 1;
+    int vMax = 1;
+    for (int n = 0; n < count; n++) {
+        hMax = std::max(hMax, j->img_comp[n].h);
+        vMax = std::max(vMax, j->img_comp[n].v);
     }
-    return palette;
+    const int mcuX = (context.img_x + hMax * 8 - 1) / (hMax * 8);
+    const int mcuY = (context.img_y + vMax * 8 - 1) / (vMax * 8);
+
+    // blocks that are never decoded stay a neutral gray
+    std::vector<BlockMeans> components(count);
+    for (int n = 0; n < count; n++) {
+        components[n].stride =
+            static_cast<std::size_t>(mcuX) * j->img_comp[n].h;
+        components[n].means.assign(
+            components[n].stride * mcuY * j->img_comp[n].v, 128);
+    }
+
+    int m = stbi__get_marker(j.get());
+    while (!stbi__EOI(m)) {
+        if (stbi__SOS(m)) {
+            if (!stbi__process_scan_header(j.get()) ||
+                !decodeScanMeans(j.get(), components, hMax, vMax, mcuX, mcuY))
+                return false;
+            if (j->marker == STBI__MARKER_none) {
+                // skip anything left before the next marker
+                while (!stbi__at_eof(&context)) {
+                    if (stbi__get8(&context) == 0xff) {
+                        j->marker = stbi__get8(&context);
+                        break;
+                    }
+                }
+            }
+        } else if (stbi__DNL(m)) {
+            stbi__get16be(&context);
+            stbi__get16be(&context);
+        } else if (!stbi__process_marker(j.get(), m)) {
+            return false;
+        }
+        m = stbi__get_marker(j.get());
+    }
+
+    width = static_cast<int>((context.img_x + 7) / 8);
+    height = static_cast<int>((context.img_y + 7) / 8);
+    // the color conversion writes a fourth byte after every pixel, so the
+    // last one needs a spare byte, as stb_image keeps for it
+    buffer.reset(
+        static_cast<RGBPixel*>(stbi__malloc_mad3(width, height, 3, 1)));
+    if (buffer == nullptr)
+        return false;
+
+    // each pixel takes the mean of the block of each component it falls in,
+    // which for subsampled chroma covers several pixels
+    const bool isRGB = isRGBJpeg(j.get());
+    std::vector<std::uint8_t> rows[3];
+    for (int n = 0; n < count; n++)
+        rows[n].resize(width);
+    for (int y = 0; y < height; y++) {
+        for (int n = 0; n < count; n++) {
+            const BlockMeans& plane = components[n];
+            const std::size_t row =
+                static_cast<std::size_t>(y) * j->img_comp[n].v / vMax;
+            for (int x = 0; x < width; x++)
+                rows[n][x] = plane.means[row * plane.stride +
+                                         x * j->img_comp[n].h / hMax];
+        }
+
+        RGBPixel* out = buffer.get() + static_cast<std::size_t>(y) * width;
+        if (count == 1 && ycbcr) {
+            for (int x = 0; x < width; x++)
+                out[x] = RGBPixel(rows[0][x], 128, 128);
+        } else if (count == 1) {
+            for (int x = 0; x < width; x++)
+                out[x] = RGBPixel(rows[0][x], rows[0][x], rows[0][x]);
+        } else if (isRGB && ycbcr) {
+            for (int x = 0; x < width; x++)
+                out[x] = encodeYCbCr(RGBPixel(rows[0][x], rows[1][x],
+                                              rows[2][x]));
+        } else if (isRGB || ycbcr) {
+            for (int x = 0; x < width; x++)
+                out[x] = RGBPixel(rows[0][x], rows[1][x], rows[2][x]);
+        } else {
+            j->YCbCr_to_RGB_kernel(reinterpret_cast<stbi_uc*>(out),
+                                   rows[0].data(), rows[1].data(),
+                                   rows[2].data(), width, 3);
+        }
+    }
+    return true;
+}
+
+// bits of each channel that pick the cell a YCbCr sample is counted in
+const int YCBCR_CELL_BITS = 5;
+
+/*
+The pixels counted into a cell, and the sums of their channels
+*/
+struct YCbCrCell {
+    std::uint_fast64_t count;
+    std::uint_fast64_t luma;
+    std::uint_fast64_t blue;
+    std::uint_fast64_t red;
+};
+
+/*
+Decodes a JPEG and counts its pixels into cells of their YCbCr colors,
+returning the mean color of every occupied cell with its count in colors,
+and true if successful. stb_image decodes each component at its own
+resolution, and every luma sample is counted with the chroma samples that
+cover it, straight from the decoded planes, so subsampled chroma is never
+upsampled, no pixel is converted, and the image is never held as pixels. A
+step above 1 counts only every step-th sample of every step-th row, and
+width and height are those of the counted image. Returns false for anything
+but a JPEG, and for JPEGs stored in RGB or CMYK
+*/
+bool loadYCbCrJpeg(const InputFile& input, std::vector<WeightedColor>& colors,
+                   int& width, int& height, const std::size_t step) {
+    stbi__context context;
+    stbi__start_mem(&context, input.data(), input.size());
+    if (!stbi__jpeg_test(&context))
+        return false;
+
+    std::unique_ptr<stbi__jpeg> j(new stbi__jpeg());
+    j->s = &context;
+    stbi__setup_jpeg(j.get());
+    context.img_n = 0;
+    if (!stbi__decode_jpeg_image(j.get()) ||
+        (context.img_n != 1 && (context.img_n != 3 || isRGBJpeg(j.get())))) {
+        stbi__cleanup_jpeg(j.get());
+        return false;
+    }
+
+    // the column each sample falls in is looked up rather than divided for,
+    // and the luma of a gray image goes with neutral chroma
+    const int count = context.img_n;
+    const std::size_t columns =
+        (static_cast<std::size_t>(context.img_x) + step - 1) / step;
+    const std::size_t rows =
+        (static_cast<std::size_t>(context.img_y) + step - 1) / step;
+    std::vector<std::uint32_t> offsets[3];
+    for (int n = 0; n < 3; n++) {
+        offsets[n].assign(columns, 0);
+        for (std::size_t x = 0; n < count && x < columns; x++)
+            offsets[n][x] = static_cast<std::uint32_t>(
+                x * step * j->img_comp[n].h / j->img_h_max);
+    }
+
+    const int shift = 8 - YCBCR_CELL_BITS;
+    std::vector<YCbCrCell> cells(std::size_t(1) << (3 * YCBCR_CELL_BITS));
+    const stbi_uc neutral = 128;
+    for (std::size_t y = 0; y < rows; y++) {
+        const stbi_uc* planes[3] = {&neutral, &neutral, &neutral};
+        for (int n = 0; n < count; n++)
+            planes[n] = j->img_comp[n].data +
+                        y * step * j->img_comp[n].v / j->img_v_max *
+                            j->img_comp[n].w2;
+        for (std::size_t x = 0; x < columns; x++) {
+            const stbi_uc luma = planes[0][offsets[0][x]];
+            const stbi_uc blue = planes[1][offsets[1][x]];
+            const stbi_uc red = planes[2][offsets[2][x]];
+            YCbCrCell& cell =
+                cells[(((luma >> shift) << YCBCR_CELL_BITS | blue >> shift)
+                       << YCBCR_CELL_BITS) |
+                      red >> shift];
+            cell.count++;
+            cell.luma += luma;
+            cell.blue += blue;
+            cell.red += red;
+        }
+    }
+    stbi__cleanup_jpeg(j.get());
+
+    auto mean = [](const std::uint_fast64_t sum,
+                   const std::uint_fast64_t n) {
+        return static_cast<std::uint8_t>((sum + n / 2) / n);
+    };
+    colors.clear();
+    for (const YCbCrCell& cell : cells)
+        if (cell.count > 0)
+            colors.push_back(WeightedColor(
+                RGBPixel(mean(cell.luma, cell.count),
+                         mean(cell.blue, cell.count),
+                         mean(cell.red, cell.count)),
+                static_cast<std::uint_fast32_t>(cell.count)));
+    width = static_cast<int>(columns);
+    height = static_cast<int>(rows);
+    return true;
+}
+
+/*
+Keeps every step-th pixel of every step-th row of an image, moved to the
+front of its buffer in place, and shrinks width and height to the sampled
+image. No pixel is ever moved past one that is still to be read
+*/
+void samplePixels(RGBPixel* pixels, int& width, int& height,
+                  const std::size_t step) {
+    const std::size_t rowLength = static_cast<std::size_t>(width);
+    const std::size_t sampledWidth = (rowLength + step - 1) / step;
+    const std::size_t sampledHeight =
+        (static_cast<std::size_t>(height) + step - 1) / step;
+    RGBPixel* out = pixels;
+    for (std::size_t y = 0; y < sampledHeight; y++) {
+        const RGBPixel* row = pixels + y * step * rowLength;
+        for (std::size_t x = 0; x < sampledWidth; x++)
+            *out++ = row[x * step];
+    }
+    width = static_cast<int>(sampledWidth);
+    height = static_cast<int>(sampledHeight);
 }
 
 /*
-Loads image as a 2D vector of RGB pixels and returns true, if successful
-If image does not exist, or is unable to be read, the vector remains empty
-and false is returned
+Loads image and returns true, if successful, with buffer owning the pixels
+stb_image decoded from input and colorData viewing them in place, as they
+are never copied. Baseline JPEGs are decoded at 1/8 of their resolution
+for a draft. If ycbcr is set, drafts are decoded straight to YCbCr, and
+ycbcr is left set only if the image was. A step above 1 keeps only every
+step-th pixel of every step-th row. If image is unable to be decoded,
+the view remains empty and false is returned. The distinct colors of the
+image are tracked along the way, until there are too many of them
 */
-bool loadImage(std::vector<RGBPixel>& colorData, const std::string& filename) {
+bool loadImage(const InputFile& input, ImageBuffer& buffer,
+               PixelView& colorData, int& width, int& height,
+               DistinctColors& distinct, const bool draft,
+               const std::size_t step, bool& ycbcr) {
     int n;
-    bool loaded = false;
-    int width, height;
     const int channels = 3;
 
-    // load 3 8-bit channels, (RGB)
-    uint8_t* data = stbi_load(filename.c_str(), &width, &height, &n, channels);
+    // load 3 8-bit channels, (RGB or YCbCr)
+    if (!draft || !loadDraftJpeg(input, buffer, width, height, ycbcr)) {
+        ycbcr = false;
+        buffer.reset(reinterpret_cast<RGBPixel*>(stbi_load_from_memory(
+            input.data(), input.size(), &width, &height, &n, channels)));
+    }
+    if (buffer == nullptr || height <= 0 || width <= 0) {
+        buffer.reset();
+        return false;
+    }
+    if (step > 1)
+        samplePixels(buffer.get(), width, height, step);
+
+    colorData = PixelView(buffer.get(), static_cast<std::size_t>(width) *
+                                            static_cast<std::size_t>(height));
 
-    unsigned long long size = height * width * channels;
-    unsigned long long dataSize = height * width;
+    // distinct colors are tracked until there are too many
+    for (const RGBPixel& pixel : colorData)
+        if (!distinct.insert(pixel))
+            break;
+    return true;
+}
 
-    if (data != nullptr && height > 0 && width > 0) {
-        colorData.resize(dataSize);
+/*
+Loads a gray image as a histogram of its levels and returns true, if
+successful. Only the decoded levels are ever held in memory, a byte per
+pixel, and any alpha channel is dropped. Baseline JPEGs are counted at 1/8
+of their resolution for a draft, and a step above 1 counts only every
+step-th level of every step-th row
+*/
+bool loadGrayImage(const InputFile& input, GrayHistogram& histogram,
+                   int& width, int& height, const bool draft,
+                   const std::size_t step) {
+    std::fill(histogram.begin(), histogram.end(), 0);
+    ImageBuffer draftPixels;
+    if (draft && loadDraftJpeg(input, draftPixels, width, height, false)) {
+        const std::size_t size =
+            static_cast<std::size_t>(width) * static_cast<std::size_t>(height);
+        for (std::size_t i = 0; i < size; i++)
+            histogram[draftPixels.get()[i].r]++;
+        return true;
+    }
 
-        unsigned long long dataIdx = 0;
-        for (unsigned long long i = 0; i < size; i += channels) {
-            uint8_t r = data[i + 0];
-            uint8_t g = data[i + 1];
-            uint8_t b = data[i + 2];
-            RGBPixel pixel(r, g, b);
-            colorData[dataIdx] = pixel;
-            dataIdx++;
-        }
+    int n;
+    uint8_t* data = stbi_load_from_memory(input.data(), input.size(), &width,
+                                          &height, &n, 1);
+    if (data == nullptr || height <= 0 || width <= 0) {
+        stbi_image_free(data);
+        return false;
+    }
 
-        loaded = true;
+    const std::size_t rowLength = static_cast<std::size_t>(width);
+    const std::size_t rows = static_cast<std::size_t>(height);
+    for (std::size_t y = 0; y < rows; y += step) {
+        const std::uint8_t* row = data + y * rowLength;
+        for (std::size_t x = 0; x < rowLength; x += step)
+            histogram[row[x]]++;
     }
     stbi_image_free(data);
-    return loaded;
+    width = static_cast<int>((rowLength + step - 1) / step);
+    height = static_cast<int>((rows + step - 1) / step);
+    return true;
+}
+
+/*
+Probing images
+
+stb_image reads the size of an image from its header without decoding it,
+so how an image is loaded can be picked before any memory is spent on it.
+Images within the pixel budget are decoded in full. Larger baseline JPEGs
+are decoded as drafts, at 1/8 of their resolution, and other images up to a
+few times the budget are decoded in full but only sampled, every few pixels
+along every few rows, so that quantizing never sees more than the budget.
+Anything larger is rejected, which keeps both the memory and the time spent
+on any one image bounded. 16 bit images count twice, as stb_image decodes
+them at 16 bits before scaling them down
+*/
+
+// how many times the budget an image may be when it is decoded in full to
+// be sampled
+const std::size_t SAMPLED_MAX_FACTOR = 4;
+
+/*
+What the header of an image tells about it
+*/
+struct ImageProbe {
+    int width;
+    int height;
+    int channels;
+    bool is16Bit;
+    bool isDraftJpeg;
+};
+
+/*
+How an image is loaded
+*/
+enum class LoadStrategy { Full, Draft, Sampled, Rejected };
+
+/*
+Reads the header of the image in input into probe, and returns true if
+stb_image can decode it
+*/
+bool probeImage(const InputFile& input, ImageProbe& probe) {
+    if (!stbi_info_from_memory(input.data(), input.size(), &probe.width,
+                               &probe.height, &probe.channels) ||
+        probe.width <= 0 || probe.height <= 0)
+        return false;
+    probe.is16Bit = stbi_is_16_bit_from_memory(input.data(), input.size());
+    stbi__context context;
+    probe.isDraftJpeg = openDraftJpeg(input, context) != nullptr;
+    return true;
+}
+
+/*
+Picks how to load a probed image, with no more than budget pixels decoded
+in full or quantized. A draft is used when one is asked for, or when the
+image is too large and the whole of it is not needed. step is set to how
+far apart the sampled pixels are, and to 1 for every other strategy
+*/
+LoadStrategy planLoad(const ImageProbe& probe, const std::size_t budget,
+                      const bool draft, const bool needsAllPixels,
+                      std::size_t& step) {
+    const std::size_t width = static_cast<std::size_t>(probe.width);
+    const std::size_t height = static_cast<std::size_t>(probe.height);
+    const std::size_t cost = width * height * (probe.is16Bit ? 2 : 1);
+    step = 1;
+
+    if (probe.isDraftJpeg && (draft || (cost > budget && !needsAllPixels)))
+        return ((width + 7) / 8) * ((height + 7) / 8) <= budget
+                   ? LoadStrategy::Draft
+                   : LoadStrategy::Rejected;
+    if (cost <= budget)
+        return LoadStrategy::Full;
+    if (needsAllPixels || cost > budget * SAMPLED_MAX_FACTOR)
+        return LoadStrategy::Rejected;
+
+    do
+        step++;
+    while (((width + step - 1) / step) * ((height + step - 1) / step) >
+           budget);
+    return LoadStrategy::Sampled;
 }
 
+// colors in the palette when no size is given
+const std::uint_fast32_t DEFAULT_COLORS = 8;
+
+// the inverse colormap numbers palette colors with 16 bits, and keeps one
+// value back for its shared cells
+const std::uint_fast32_t MAX_COLORS = 0xffff;
+
+// the most colors an automatic palette may have, and how much a split must
+// lower the squared error per pixel for it to be worth a color, by default
+const std::uint_fast32_t AUTO_MAX_COLORS = 64;
+const std::uint_fast32_t AUTO_MIN_GAIN = 16;
+
+// the most pixels an image is decoded or quantized with, by default, about
+// 33 megapixels
+const std::uint_fast32_t DEFAULT_MAX_PIXELS = 1 << 25;
+
+// images with up to this many colors are shown as they are, as their
+// pixels are counted by searching the colors one by one
+const std::size_t DISTINCT_MAX_COLORS = 256;
+
 /*
 Pads number with spaces to make it 3 characters wide
 */
@@ -181,32 +3954,172 @@ std::string padEnd(const std::uint_fast32_t x) {
 }
 
 /*
-Uses a simple string hash to make all of the obtained colors unique
+Parses a non-negative integer argument, and returns true if successful
+*/
+bool parseCount(const std::string& arg, std::uint_fast32_t& count) {
+    if (arg.empty() ||
+        arg.find_first_not_of("0123456789") != std::string::npos ||
+        arg.size() > 9)
+        return false;
+    count = static_cast<std::uint_fast32_t>(std::stoul(arg));
+    return true;
+}
+
+/*
+Parses a comma separated list of palette sizes, each between 1 and
+MAX_COLORS, and returns true if successful
 */
-std::vector<RGBPixel> makeColorsUnique(const std::vector<RGBPixel>& colors) {
-    std::vector<RGBPixel> uniqueColors;
+bool parseSizes(const std::string& arg,
+                std::vector<std::uint_fast32_t>& sizes) {
+    std::vector<std::uint_fast32_t> parsed;
+    std::size_t start = 0;
+    while (true) {
+        const std::size_t comma = arg.find(',', start);
+        std::uint_fast32_t size;
+        if (!parseCount(arg.substr(start, comma - start), size) ||
+            size == 0 || size > MAX_COLORS)
+            return false;
+        parsed.push_back(size);
+        if (comma == std::string::npos)
+            break;
+        start = comma + 1;
+    }
+    sizes = parsed;
+    return true;
+}
 
-    std::unordered_set<std::string> uniqueColorSet;
-    for (const auto& color : colors) {
-        std::string hash = std::to_string(color.r) + "|" +
-                           std::to_string(color.g) + "|" +
-                           std::to_string(color.b);
-        if (uniqueColorSet.find(hash) != std::end(uniqueColorSet))
+/*
+Merges palette colors that are too close to tell apart, keeping at most
+limit of them. Exact duplicates are dropped by their packed keys first.
+Then the closest remaining pair is found over and over, and merged into
+the mean of its two colors in OKLab, weighted by their pixel counts, for as
+long as the pair is within threshold, as delta-E in OKLab units times 100,
+or there are more than limit colors left. Merging into the mean rather than
+into either color stops a row of close colors from being chained into one
+that stands for colors much further than threshold away
+*/
+std::vector<WeightedColor>
+mergeSimilarColors(const std::vector<WeightedColor>& colors,
+                   const float threshold, const std::size_t limit) {
+    std::vector<WeightedColor> merged;
+    std::vector<std::uint32_t> keys;
+    for (const WeightedColor& color : colors) {
+        const std::uint32_t key = packColor(color.color);
+        const std::vector<std::uint32_t>::iterator found =
+            std::find(keys.begin(), keys.end(), key);
+        if (found != keys.end()) {
+            merged[found - keys.begin()].count += color.count;
             continue;
+        }
+        keys.push_back(key);
+        merged.push_back(color);
+    }
+
+    std::vector<std::array<float, 3>> labs;
+    for (const WeightedColor& color : merged)
+        labs.push_back(toOklab(color.color));
+    auto distance = [&](const std::size_t i, const std::size_t j) {
+        const float dl = labs[i][0] - labs[j][0];
+        const float da = labs[i][1] - labs[j][1];
+        const float db = labs[i][2] - labs[j][2];
+        return 100.0f * std::sqrt(dl * dl + da * da + db * db);
+    };
+
+    // every color keeps the closest of the colors after it, so that after
+    // a merge only the merged color, and the colors whose closest was one
+    // of the pair, need searching again. Any other color only has to check
+    // whether the merged color moved closer to it
+    const std::size_t count = merged.size();
+    std::vector<bool> alive(count, true);
+    std::vector<float> closestDistance(count, FLT_MAX);
+    std::vector<std::size_t> closestColor(count, count);
+    auto findClosest = [&](const std::size_t i) {
+        closestDistance[i] = FLT_MAX;
+        closestColor[i] = count;
+        for (std::size_t j = i + 1; j < count; j++) {
+            if (!alive[j])
+                continue;
+            const float d = distance(i, j);
+            if (d < closestDistance[i]) {
+                closestDistance[i] = d;
+                closestColor[i] = j;
+            }
+        }
+    };
+    for (std::size_t i = 0; i < count; i++)
+        findClosest(i);
+
+    std::size_t remaining = count;
+    while (remaining > 1) {
+        float closest = FLT_MAX;
+        std::size_t keep = 0;
+        for (std::size_t i = 0; i < count; i++) {
+            if (alive[i] && closestDistance[i] < closest) {
+                closest = closestDistance[i];
+                keep = i;
+            }
+        }
+        if (closest > threshold && remaining <= limit)
+            break;
+
+        const std::size_t drop = closestColor[keep];
+        const double total =
+            static_cast<double>(merged[keep].count) + merged[drop].count;
+        if (total > 0) {
+            for (std::size_t c = 0; c < 3; c++)
+                labs[keep][c] = static_cast<float>(
+                    (labs[keep][c] * merged[keep].count +
+                     labs[drop][c] * merged[drop].count) /
+                    total);
+            merged[keep].color = fromOklab(labs[keep]);
+        }
+        merged[keep].count += merged[drop].count;
+        alive[drop] = false;
+        remaining--;
 
-        uniqueColorSet.insert(hash);
-        uniqueColors.push_back(color);
+        findClosest(keep);
+        for (std::size_t i = 0; i < drop; i++) {
+            if (!alive[i] || i == keep)
+                continue;
+            if (closestColor[i] == keep || closestColor[i] == drop) {
+                findClosest(i);
+            } else if (i < keep) {
+                const float d = distance(i, keep);
+                if (d < closestDistance[i]) {
+                    closestDistance[i] = d;
+                    closestColor[i] = keep;
+                }
+            }
+        }
     }
 
-    return uniqueColors;
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < count; i++)
+        if (alive[i])
+            merged[kept++] = merged[i];
+    merged.resize(kept);
+    return merged;
+}
+
+/*
+Prints how many pixels a palette color stands for, and which share of the
+image that is
+*/
+void displayPopulation(const WeightedColor& color,
+                       const std::size_t totalPixels) {
+    const double coverage = 100.0 * color.count / totalPixels;
+    std::cout << "\t" << std::dec << color.count << "\t" << std::fixed
+              << std::setprecision(2) << coverage << "%";
 }
 
 /*
 Display dominant colors in Truecolor (for supported terminals only)
 */
-void displayTruecolor(const std::vector<RGBPixel>& colors) {
+void displayTruecolor(const std::vector<WeightedColor>& colors,
+                      const std::size_t totalPixels) {
     std::cout << "\n";
-    for (const auto& color : colors) {
+    for (const auto& entry : colors) {
+        const RGBPixel& color = entry.color;
         std::string colorString = "\x1b[38;2;" + std::to_string(color.r) + ";" +
                                   std::to_string(color.g) + ";" +
                                   std::to_string(color.b) +
@@ -219,7 +4132,9 @@ void displayTruecolor(const std::vector<RGBPixel>& colors) {
 
         std::cout << "#" << std::hex << static_cast<std::uint_fast32_t>(color.r)
                   << static_cast<std::uint_fast32_t>(color.g)
-                  << static_cast<std::uint_fast32_t>(color.b) << "\n";
+                  << static_cast<std::uint_fast32_t>(color.b);
+        displayPopulation(entry, totalPixels);
+        std::cout << "\n";
     }
 }
 
@@ -253,9 +4168,11 @@ std::uint_fast32_t RGBtoANSI(const RGBPixel& color) {
 /*
 Display dominant colors in ANSI
 */
-void displayANSI(const std::vector<RGBPixel>& colors) {
+void displayANSI(const std::vector<WeightedColor>& colors,
+                 const std::size_t totalPixels) {
     std::cout << "\n";
-    for (const auto& color : colors) {
+    for (const auto& entry : colors) {
+        const RGBPixel& color = entry.color;
         std::uint_fast32_t ansiCode = RGBtoANSI(color);
         std::string colorString =
             "\033[38;5;" + std::to_string(ansiCode) + "m██████████\033[0;00m";
@@ -267,11 +4184,214 @@ void displayANSI(const std::vector<RGBPixel>& colors) {
 
         std::cout << "#" << std::hex << static_cast<std::uint_fast32_t>(color.r)
                   << static_cast<std::uint_fast32_t>(color.g)
-                  << static_cast<std::uint_fast32_t>(color.b) << "\n";
+                  << static_cast<std::uint_fast32_t>(color.b);
+        displayPopulation(entry, totalPixels);
+        std::cout << "\n";
     }
     std::cout << "\nANSI\n";
 }
 
+// times the engine is asked for more colors to refill a merged palette, and
+// the most colors it is asked for, as a multiple of the palette size
+const int PALETTE_REFILLS = 4;
+const std::uint_fast32_t PALETTE_MAX_REQUEST = 4;
+
+/*
+Asks quantize for a palette of numColors colors, and merges colors within
+mergeThreshold of each other. The freed slots are refilled by asking for
+more colors, which for the greedy engines means splitting the next best
+boxes, until the palette is full or the image has no more colors to give.
+The next boxes often hold colors close to the ones just merged, so each
+refill asks for twice as many extra colors as the last, up to a few times
+the palette size, which bounds the cost of merging them
+*/
+template <typename Quantize>
+std::vector<WeightedColor> fillPalette(const std::uint_fast32_t numColors,
+                                       const float mergeThreshold,
+                                       Quantize& quantize) {
+    std::uint_fast32_t requested = numColors;
+    std::vector<WeightedColor> palette = quantize(requested);
+    std::vector<WeightedColor> merged =
+        mergeSimilarColors(palette, mergeThreshold, numColors);
+    for (int refill = 0; refill < PALETTE_REFILLS; refill++) {
+        if (merged.size() >= numColors || palette.size() < requested)
+            break;
+        const std::uint_fast32_t freed =
+            numColors - static_cast<std::uint_fast32_t>(merged.size());
+        const std::uint_fast32_t wanted = std::min(
+            requested + (freed << refill), numColors * PALETTE_MAX_REQUEST);
+        if (wanted <= requested)
+            break;
+        requested = wanted;
+        palette = quantize(requested);
+        merged = mergeSimilarColors(palette, mergeThreshold, numColors);
+    }
+    return merged;
+}
+
+/*
+Picks a palette of each of the given sizes for the image with the given
+engine, in the given color space, and refining them if asked to. The
+pixels are converted to the space first, unless isEncoded says they were
+decoded in it, and the palettes are converted back to sRGB. When the image
+was counted into colors in the space as it was decoded, they are quantized
+in place of its pixels.
+
+Median cut is run once, for the largest size, and the palettes of every
+size are read off its palette tree, cut short where the splits stop
+lowering the error by minGain per pixel. The other engines are run once
+per size. Colors within mergeThreshold of each other are merged
+*/
+std::vector<std::vector<WeightedColor>>
+generatePalettes(const PixelView& source,
+                 const std::vector<WeightedColor>& counted,
+                 const std::vector<std::uint_fast32_t>& sizes,
+                 const std::string& engine, const ColorSpace space,
+                 const bool isEncoded, const SplitPolicy policy,
+                 const bool linearAverage,
+                 const std::uint_fast32_t refineIterations,
+                 const float mergeThreshold, const float minGain,
+                 WorkerPool& pool) {
+    // the histogram engine works on the cells of a color histogram, and
+    // median cut on the unique colors of the image when there are few
+    // enough of them, rather than on every pixel
+    std::vector<WeightedColor> weightedColors;
+    bool isWeighted = false;
+    if (!counted.empty()) {
+        weightedColors = counted;
+        isWeighted = true;
+    } else if (engine == "histogram") {
+        weightedColors = buildColorHistogram(source);
+        isWeighted = true;
+    } else if (engine == "median") {
+        isWeighted = findUniqueColors(source, weightedColors);
+    }
+
+    // large images are counted into cells for OKLab, whatever the engine,
+    // and the cells come out converted already
+    bool isCounted = !counted.empty();
+    if (space == ColorSpace::Oklab && !isEncoded && !isWeighted &&
+        source.size() >= OKLAB_CELLS) {
+        weightedColors = countOklabCells(source, pool);
+        isWeighted = true;
+        isCounted = true;
+    }
+
+    // only the weighted colors need converting when there are any, and
+    // none do when the image was decoded in the color space already
+    std::vector<RGBPixel> encodedData;
+    const bool isConverted =
+        space != ColorSpace::SRGB && !isEncoded && !isCounted;
+    if (isConverted && isWeighted && space == ColorSpace::Oklab)
+        encodeOklab(weightedColors);
+    else if (isConverted && isWeighted)
+        for (WeightedColor& color : weightedColors)
+            color.color = encodeColor(color.color, space);
+    else if (isConverted && space == ColorSpace::Oklab)
+        encodeOklab(source, encodedData, pool);
+    else if (isConverted)
+        encodeYCbCr(source, encodedData, pool);
+    const PixelView colorData =
+        isConverted && !isWeighted ? PixelView(encodedData) : source;
+
+    // the tree is only run again when a refill asks for more colors than
+    // it was run for
+    const bool isTree = engine == "median" || engine == "histogram";
+    PaletteTree tree;
+    std::uint_fast32_t treeSize = 0;
+    auto buildTree = [&](const std::uint_fast32_t count) {
+        if (isWeighted)
+            tree = weightedMedianCutBuildTree(weightedColors, count, policy,
+                                              linearAverage, pool);
+        else
+            tree = medianCutBuildTree(colorData, count, policy,
+                                      linearAverage, pool);
+        treeSize = count;
+    };
+    if (isTree)
+        buildTree(*std::max_element(sizes.begin(), sizes.end()));
+
+    auto quantize = [&](const std::uint_fast32_t count) {
+        std::vector<WeightedColor> palette;
+        if (isTree) {
+            if (count > treeSize)
+                buildTree(count);
+            palette = treePalette(tree,
+                                  std::min(count, treeColors(tree, minGain)));
+        } else if (engine == "wu") {
+            palette = isWeighted ? wuGeneratePalette(weightedColors, count)
+                                 : wuGeneratePalette(colorData, count);
+        } else {
+            palette = isWeighted ? octreeGeneratePalette(weightedColors, count)
+                                 : octreeGeneratePalette(colorData, count);
+        }
+
+        // refine over the same data the palette was picked from
+        if (refineIterations > 0) {
+            if (isWeighted)
+                palette = kMeansRefinePalette(weightedColors, palette,
+                                              refineIterations, pool);
+            else
+                palette = kMeansRefinePalette(colorData, palette,
+                                              refineIterations, pool);
+        }
+
+        if (space != ColorSpace::SRGB)
+            for (WeightedColor& color : palette)
+                color.color = decodeColor(color.color, space);
+        return palette;
+    };
+
+    std::vector<std::vector<WeightedColor>> palettes;
+    for (const std::uint_fast32_t numColors : sizes)
+        palettes.push_back(
+            fillPalette(numColors, mergeThreshold, quantize));
+    return palettes;
+}
+
+/*
+Picks the optimal palette of each of the given sizes for a gray image from
+the histogram of its levels, cut short where a color stops lowering the
+error by minGain per pixel. The palettes are already optimal, so there is
+nothing to refine
+*/
+std::vector<std::vector<WeightedColor>>
+generateGrayPalettes(const GrayHistogram& histogram,
+                     const std::vector<std::uint_fast32_t>& sizes,
+                     const float mergeThreshold, const float minGain) {
+    GrayPartition partition;
+    std::uint_fast32_t partitionSize = 0;
+    auto quantize = [&](const std::uint_fast32_t count) {
+        if (count > partitionSize) {
+            partition = partitionGrayLevels(histogram, count);
+            partitionSize = count;
+        }
+        return grayPalette(partition,
+                           std::min(count, grayColors(partition, minGain)));
+    };
+    quantize(*std::max_element(sizes.begin(), sizes.end()));
+
+    std::vector<std::vector<WeightedColor>> palettes;
+    for (const std::uint_fast32_t numColors : sizes)
+        palettes.push_back(
+            fillPalette(numColors, mergeThreshold, quantize));
+    return palettes;
+}
+
+/*
+Reports how long loading, quantizing and remapping the image took, on stderr
+so that the palette output stays untouched
+*/
+void displayTimings(const std::chrono::steady_clock::duration load,
+                    const std::chrono::steady_clock::duration quantize,
+                    const std::chrono::steady_clock::duration remap) {
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+    std::cerr << "LOAD: " << Milliseconds(load).count() << " ms\n"
+              << "QUANTIZE: " << Milliseconds(quantize).count() << " ms\n";
+    if (remap != std::chrono::steady_clock::duration::zero())
+        std::cerr << "REMAP: " << Milliseconds(remap).count() << " ms\n";
+}
+
 int main(int argv, char** argc) {
     if (argv < 2) {
         std::cerr << "INVALID NUMBER OF ARGUMENTS!\n";
@@ -279,25 +4399,266 @@ int main(int argv, char** argc) {
     }
 
     bool isTruecolor = true;
-    if (argv == 3 && std::string(argc[2]) == std::string("ANSI")) {
-        isTruecolor = false;
+    std::vector<std::uint_fast32_t> sizes(1, DEFAULT_COLORS);
+    bool autoSize = false;
+    std::uint_fast32_t minGain = 0;
+    std::string engine = "median";
+    std::string space = "srgb";
+    std::string split = "median";
+    std::uint_fast32_t refineIterations = 0;
+    std::uint_fast32_t mergeThreshold = 0;
+    bool showTimings = false;
+    bool sortByDominance = false;
+    std::string outputPath;
+    bool dither = false;
+    bool draft = false;
+    std::uint_fast32_t maxPixels = DEFAULT_MAX_PIXELS;
+    bool linearAverage = false;
+    std::uint_fast32_t numThreads =
+        std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 2; i < argv; i++) {
+        std::string arg(argc[i]);
+        if (arg == "ANSI") {
+            isTruecolor = false;
+        } else if (arg == "--engine" && i + 1 < argv) {
+            engine = argc[++i];
+        } else if (arg == "--split" && i + 1 < argv) {
+            split = argc[++i];
+        } else if (arg == "--space" && i + 1 < argv) {
+            space = argc[++i];
+        } else if (arg == "--time") {
+            showTimings = true;
+        } else if (arg == "--output" && i + 1 < argv) {
+            outputPath = argc[++i];
+        } else if (arg == "--dither") {
+            dither = true;
+        } else if (arg == "--draft") {
+            draft = true;
+        } else if (arg == "--sort") {
+            sortByDominance = true;
+        } else if (arg == "--linear") {
+            linearAverage = true;
+        } else if (arg == "--threads" && i + 1 < argv) {
+            if (!parseCount(argc[++i], numThreads) || numThreads == 0) {
+                std::cerr << "INVALID NUMBER OF THREADS!\n";
+                return 1;
+            }
+        } else if (arg == "--colors" && i + 1 < argv) {
+            const std::string list(argc[++i]);
+            autoSize = list == "auto";
+            if (autoSize) {
+                sizes.assign(1, AUTO_MAX_COLORS);
+            } else if (!parseSizes(list, sizes)) {
+                std::cerr << "INVALID NUMBER OF COLORS!\n";
+                return 1;
+            }
+        } else if (arg == "--max-pixels" && i + 1 < argv) {
+            if (!parseCount(argc[++i], maxPixels) || maxPixels == 0) {
+                std::cerr << "INVALID PIXEL BUDGET!\n";
+                return 1;
+            }
+        } else if (arg == "--min-gain" && i + 1 < argv) {
+            if (!parseCount(argc[++i], minGain)) {
+                std::cerr << "INVALID MINIMUM GAIN!\n";
+                return 1;
+            }
+        } else if (arg == "--merge" && i + 1 < argv) {
+            if (!parseCount(argc[++i], mergeThreshold)) {
+                std::cerr << "INVALID MERGE THRESHOLD!\n";
+                return 1;
+            }
+        } else if (arg == "--refine" && i + 1 < argv) {
+            if (!parseCount(argc[++i], refineIterations)) {
+                std::cerr << "INVALID NUMBER OF ITERATIONS!\n";
+                return 1;
+            }
+        } else {
+            std::cerr << "INVALID ARGUMENT: " << arg << "\n";
+            return 1;
+        }
     }
 
-    std::string filename(argc[1]);
-    std::vector<RGBPixel> colorData;
+    if (engine != "median" && engine != "histogram" && engine != "wu" &&
+        engine != "octree") {
+        std::cerr << "UNKNOWN ENGINE: " << engine << "\n";
+        return 1;
+    }
 
-    if (!loadImage(colorData, filename)) {
-        std::cerr << "FAILED TO LOAD IMAGE!\n";
+    if (autoSize && minGain == 0)
+        minGain = AUTO_MIN_GAIN;
+    if (minGain > 0 && engine != "median" && engine != "histogram") {
+        std::cerr << "PALETTE SIZES BY GAIN NEED THE MEDIAN OR HISTOGRAM "
+                     "ENGINE!\n";
         return 1;
     }
 
-    std::vector<RGBPixel> colors =
-        makeColorsUnique(medianCutGeneratePalette(colorData, 8));
+    if (!outputPath.empty() && sizes.size() > 1) {
+        std::cerr << "AN OUTPUT IMAGE NEEDS A SINGLE PALETTE SIZE!\n";
+        return 1;
+    }
 
-    if (isTruecolor)
-        displayTruecolor(colors);
-    else
-        displayANSI(colors);
+    if (draft && !outputPath.empty()) {
+        std::cerr << "DRAFT DECODING CANNOT WRITE AN OUTPUT IMAGE!\n";
+        return 1;
+    }
+
+    if (dither && outputPath.empty()) {
+        std::cerr << "DITHERING NEEDS AN OUTPUT IMAGE!\n";
+        return 1;
+    }
+
+    if (space != "srgb" && space != "oklab" && space != "ycbcr") {
+        std::cerr << "UNKNOWN COLOR SPACE: " << space << "\n";
+        return 1;
+    }
+
+    if (split != "median" && split != "variance") {
+        std::cerr << "UNKNOWN SPLIT POLICY: " << split << "\n";
+        return 1;
+    }
+    if (split != "median" && engine != "median" && engine != "histogram") {
+        std::cerr << "SPLIT POLICIES NEED THE MEDIAN OR HISTOGRAM ENGINE!\n";
+        return 1;
+    }
+    const SplitPolicy policy =
+        split == "variance" ? SplitPolicy::Variance : SplitPolicy::Median;
+
+    // only median cut averages sRGB bytes itself
+    if (linearAverage &&
+        (space != "srgb" || (engine != "median" && engine != "histogram"))) {
+        std::cerr << "LINEAR AVERAGING NEEDS THE MEDIAN OR HISTOGRAM ENGINE "
+                     "IN SRGB!\n";
+        return 1;
+    }
+
+    std::string filename(argc[1]);
+    ImageBuffer decoded;
+    PixelView colorData;
+    DistinctColors distinct(std::min(
+        *std::min_element(sizes.begin(), sizes.end()), DISTINCT_MAX_COLORS));
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    // the header of the image picks how it is loaded, and gray images are
+    // quantized from the histogram of their levels, unless their pixels are
+    // needed in color, to remap them or to convert them. The file is let go
+    // of as soon as it is decoded
+    int width, height;
+    bool isGray;
+    bool isYCbCr = space == "ycbcr" && outputPath.empty();
+    GrayHistogram grayLevels;
+    std::vector<WeightedColor> counted;
+    {
+        const InputFile input(filename);
+        ImageProbe probe;
+        if (!input.loaded() || !probeImage(input, probe)) {
+            std::cerr << "FAILED TO LOAD IMAGE!\n";
+            return 1;
+        }
+
+        std::size_t step;
+        const LoadStrategy strategy =
+            planLoad(probe, maxPixels, draft, !outputPath.empty(), step);
+        if (strategy == LoadStrategy::Rejected) {
+            std::cerr << "IMAGE IS LARGER THAN THE PIXEL BUDGET!\n";
+            return 1;
+        }
+
+        const bool isDraft = strategy == LoadStrategy::Draft;
+        isGray = probe.channels <= 2 && outputPath.empty() &&
+                 space == "srgb" && !linearAverage;
+        // JPEGs quantized in YCbCr are counted into cells as they are
+        // decoded, and never held as pixels
+        bool isLoaded;
+        if (isGray)
+            isLoaded = loadGrayImage(input, grayLevels, width, height,
+                                     isDraft, step);
+        else if (isYCbCr && !isDraft &&
+                 loadYCbCrJpeg(input, counted, width, height, step))
+            isLoaded = true;
+        else
+            isLoaded = loadImage(input, decoded, colorData, width, height,
+                                 distinct, isDraft, step, isYCbCr);
+        if (!isLoaded) {
+            std::cerr << "FAILED TO LOAD IMAGE!\n";
+            return 1;
+        }
+    }
+    const std::size_t totalPixels =
+        static_cast<std::size_t>(width) * static_cast<std::size_t>(height);
+    std::chrono::steady_clock::time_point loaded =
+        std::chrono::steady_clock::now();
+
+    // an image with no more colors than the smallest palette is shown as it
+    // is, most common color first, for every size
+    WorkerPool pool(numThreads);
+    std::vector<std::vector<WeightedColor>> palettes;
+    if (isGray) {
+        palettes = generateGrayPalettes(grayLevels, sizes,
+                                        static_cast<float>(mergeThreshold),
+                                        static_cast<float>(minGain));
+    } else if (counted.empty() && !distinct.overflowed) {
+        // the colors are merged like any other palette, which also folds
+        // colors decoded in YCbCr that come out the same in sRGB. There are
+        // no more colors to refill the palette with
+        std::vector<WeightedColor> colors =
+            countDistinctColors(colorData, distinct.colors);
+        if (isYCbCr)
+            for (WeightedColor& color : colors)
+                color.color = decodeYCbCr(color.color);
+        auto quantize = [&](const std::uint_fast32_t) { return colors; };
+        for (const std::uint_fast32_t numColors : sizes)
+            palettes.push_back(fillPalette(
+                numColors, static_cast<float>(mergeThreshold), quantize));
+    } else {
+        const ColorSpace colorSpace = space == "oklab"   ? ColorSpace::Oklab
+                                      : space == "ycbcr" ? ColorSpace::YCbCr
+                                                         : ColorSpace::SRGB;
+        palettes = generatePalettes(
+            colorData, counted, sizes, engine, colorSpace, isYCbCr, policy,
+            linearAverage, refineIterations,
+            static_cast<float>(mergeThreshold), static_cast<float>(minGain),
+            pool);
+    }
+
+    if (sortByDominance)
+        for (std::vector<WeightedColor>& palette : palettes)
+            std::stable_sort(
+                palette.begin(), palette.end(),
+                [](const WeightedColor& a, const WeightedColor& b) {
+                    return a.count > b.count;
+                });
+    std::chrono::steady_clock::time_point quantized =
+        std::chrono::steady_clock::now();
+
+    std::chrono::steady_clock::time_point remapped = quantized;
+    if (!outputPath.empty()) {
+        // the pixels are not needed any more, so they are remapped in place,
+        // straight in the buffer they were decoded into
+        const InverseColormap map = buildInverseColormap(palettes[0]);
+        if (dither)
+            ditherImage(colorData, width, height, map);
+        else
+            remapImage(colorData, map, pool);
+        remapped = std::chrono::steady_clock::now();
+
+        if (!writePPM(outputPath, colorData, width, height)) {
+            std::cerr << "FAILED TO WRITE IMAGE!\n";
+            return 1;
+        }
+    }
+
+    if (showTimings)
+        displayTimings(loaded - start, quantized - loaded,
+                       remapped - quantized);
+
+    for (const std::vector<WeightedColor>& palette : palettes) {
+        if (isTruecolor)
+            displayTruecolor(palette, totalPixels);
+        else
+            displayANSI(palette, totalPixels);
+    }
 
     return 0;
 }
\ No newline at end of file